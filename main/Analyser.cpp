@@ -14,15 +14,23 @@
 */
 
 #include "Analyser.h"
+#include "AnalysisCache.h"
+#include "RangeTransformCommand.h"
+#include "NoteBoundaryIndex.h"
+#include "PitchTrackIndex.h"
 
 #include "transform/TransformFactory.h"
 #include "transform/ModelTransformer.h"
 #include "transform/FeatureExtractionModelTransformer.h"
 #include "framework/Document.h"
 #include "data/model/WaveFileModel.h"
+#include "data/model/NoteModel.h"
+#include "data/model/SparseTimeValueModel.h"
+#include "data/model/EventCommands.h"
 #include "view/Pane.h"
 #include "view/PaneStack.h"
 #include "layer/Layer.h"
+#include "layer/SingleColourLayer.h"
 #include "layer/TimeValueLayer.h"
 #include "layer/NoteLayer.h"
 #include "layer/FlexiNoteLayer.h"
@@ -36,17 +44,42 @@
 
 #include <QSettings>
 #include <QMutexLocker>
+#include <QTimer>
+
+#include <algorithm>
 
 using std::vector;
 
+static const QString previewName = "preview";
+
 Analyser::Analyser() :
     m_document(0),
     m_paneStack(0),
     m_pane(0),
     m_currentCandidate(-1),
     m_candidatesVisible(false),
-    m_currentAsyncHandle(0)
+    m_currentAsyncHandle(0),
+    m_currentAsyncFrames(0),
+    m_candidateFramesStarted(0),
+    m_candidateFramesWasted(0),
+    m_candidateFramesAvoided(0),
+    m_reAnalysisTimer(new QTimer(this)),
+    m_speculativeHits(0),
+    m_speculativeMisses(0),
+    m_previewTimer(new QTimer(this)),
+    m_noteIndex(new NoteBoundaryIndex(this)),
+    m_pitchIndex(new PitchTrackIndex(this))
 {
+    m_previewTimer->setSingleShot(true);
+    m_previewTimer->setInterval(300);
+    connect(m_previewTimer, SIGNAL(timeout()),
+            this, SLOT(addPreviewAnalysis()));
+
+    m_reAnalysisTimer->setSingleShot(true);
+    m_reAnalysisTimer->setInterval(100);
+    connect(m_reAnalysisTimer, SIGNAL(timeout()),
+            this, SLOT(startPendingReAnalysis()));
+
     QSettings settings;
     settings.beginGroup("LayerDefaults");
     settings.setValue
@@ -77,6 +110,74 @@ Analyser::getAnalysisSettings()
     };
 }
 
+Transform
+Analyser::getAnalysisTransform(sv_samplerate_t sampleRate)
+{
+    QSettings settings;
+    settings.beginGroup("Analyser");
+
+    bool precise = false, lowamp = true, onset = true, prune = true;
+    
+    std::map<QString, bool &> flags {
+        { "precision-analysis", precise },
+        { "lowamp-analysis", lowamp },
+        { "onset-analysis", onset },
+        { "prune-analysis", prune }
+    };
+
+    auto keyMap = getAnalysisSettings();
+    
+    for (auto p: flags) {
+        auto ki = keyMap.find(p.first);
+        if (ki != keyMap.end()) {
+            p.second = settings.value(ki->first, ki->second).toBool();
+        } else {
+            throw std::logic_error("Internal error: One or more analysis settings keys not found in map: check getAnalysisTransform and getAnalysisSettings");
+        }
+    }
+
+    settings.endGroup();
+
+    Transform t = TransformFactory::getInstance()->getDefaultTransformFor
+        ("vamp:pyin:pyin:smoothedpitchtrack", sampleRate);
+    t.setStepSize(256);
+    t.setBlockSize(2048);
+
+    if (precise) {
+        cerr << "setting parameters for precise mode" << endl;
+        t.setParameter("precisetime", 1);
+    } else {
+        cerr << "setting parameters for vague mode" << endl;
+        t.setParameter("precisetime", 0);
+    }
+
+    if (lowamp) {
+        cerr << "setting parameters for lowamp suppression" << endl;
+        t.setParameter("lowampsuppression", 0.2f);
+    } else {
+        cerr << "setting parameters for no lowamp suppression" << endl;
+        t.setParameter("lowampsuppression", 0.0f);
+    }
+
+    if (onset) {
+        cerr << "setting parameters for increased onset sensitivity" << endl;
+        t.setParameter("onsetsensitivity", 0.7f);
+    } else {
+        cerr << "setting parameters for non-increased onset sensitivity" << endl;
+        t.setParameter("onsetsensitivity", 0.0f);
+    }
+
+    if (prune) {
+        cerr << "setting parameters for duration pruning" << endl;
+        t.setParameter("prunethresh", 0.1f);
+    } else {
+        cerr << "setting parameters for no duration pruning" << endl;
+        t.setParameter("prunethresh", 0.0f);
+    }
+
+    return t;
+}
+
 QString
 Analyser::newFileLoaded(Document *doc, ModelId model,
 			PaneStack *paneStack, Pane *pane)
@@ -93,6 +194,11 @@ Analyser::newFileLoaded(Document *doc, ModelId model,
     connect(doc, SIGNAL(layerAboutToBeDeleted(Layer *)),
             this, SLOT(layerAboutToBeDeleted(Layer *)));
 
+    connect(pane, SIGNAL(centreFrameChanged(sv_frame_t, bool, PlaybackFollowMode)),
+            this, SLOT(viewportChanged()), Qt::UniqueConnection);
+    connect(pane, SIGNAL(zoomLevelChanged(ZoomLevel, bool)),
+            this, SLOT(viewportChanged()), Qt::UniqueConnection);
+
     QSettings settings;
     settings.beginGroup("Analyser");
     bool autoAnalyse = settings.value("auto-analysis", true).toBool();
@@ -125,9 +231,16 @@ Analyser::analyseExistingFile()
 QString
 Analyser::doAllAnalyses(bool withPitchTrack)
 {
+    {
+        QMutexLocker locker(&m_asyncMutex);
+        discardSpeculativeAnalyses();
+    }
+    removePreviewAnalyses();
+    
     m_reAnalysingSelection = Selection();
     m_reAnalysisCandidates.clear();
     m_currentCandidate = -1;
+    m_chosenSelections.clear();
     m_candidatesVisible = false;
 
     // Note that we need at least one main-model layer (time ruler,
@@ -145,6 +258,19 @@ Analyser::doAllAnalyses(bool withPitchTrack)
     error = addWaveform();
     if (error != "") return error;
 
+    // A session saved during the initial analysis may include the
+    // preview layers, which have no further use
+    vector<Layer *> previews;
+    for (int i = 0; i < m_pane->getLayerCount(); ++i) {
+        if (m_pane->getLayer(i)->getPresentationName() == previewName) {
+            previews.push_back(m_pane->getLayer(i));
+        }
+    }
+    for (Layer *layer: previews) {
+        cerr << "removing preview layer saved with session" << endl;
+        m_document->removeLayerFromView(m_pane, layer);
+    }
+
     if (withPitchTrack) {
         error = addAnalyses();
         if (error != "") return error;
@@ -166,10 +292,21 @@ void
 Analyser::fileClosed()
 {
     cerr << "Analyser::fileClosed" << endl;
+    {
+        QMutexLocker locker(&m_asyncMutex);
+        discardSpeculativeAnalyses();
+    }
+    removePreviewAnalyses();
     m_layers.clear();
     m_reAnalysisCandidates.clear();
     m_currentCandidate = -1;
+    m_chosenSelections.clear();
     m_reAnalysingSelection = Selection();
+    m_analysisTransform = Transform();
+    m_analysisCacheKey = "";
+    m_preAnalysis.clear();
+    m_noteIndex->setModel(ModelId());
+    m_pitchIndex->setModel(ModelId());
 }
 
 bool
@@ -213,6 +350,27 @@ Analyser::layerCompletionChanged(ModelId)
 
     emit initialAnalysisCompleted();
 
+    removePreviewAnalyses();
+
+    if (m_analysisCacheKey != "" && m_layers[PitchTrack] && m_layers[Notes]) {
+        AnalysisCache::getInstance()->store(m_analysisCacheKey,
+                                            m_layers[PitchTrack]->getModel(),
+                                            m_layers[Notes]->getModel());
+        m_analysisCacheKey = "";
+    }
+
+    extendAnalysisLayers();
+}
+
+void
+Analyser::audioModelReady(ModelId)
+{
+    extendAnalysisLayers();
+}
+
+void
+Analyser::extendAnalysisLayers()
+{
     if (!m_layers[Audio]) {
         return;
     }
@@ -222,6 +380,7 @@ Analyser::layerCompletionChanged(ModelId)
     // on export etc.
 
     auto audioModel = ModelById::get(m_layers[Audio]->getModel());
+    if (!audioModel) return;
     sv_frame_t endFrame = audioModel->getEndFrame();
         
     if (m_layers[PitchTrack]) {
@@ -348,6 +507,9 @@ Analyser::addAnalyses()
     if (!waveFileModel) {
         return "Internal error: Analyser::addAnalyses() called with no model present";
     }
+
+    m_analysisTransform = Transform();
+    m_analysisCacheKey = "";
     
     // As with the spectrogram above, if these layers exist we use
     // them
@@ -406,67 +568,22 @@ Analyser::addAnalyses()
 	return notFound.arg(base + noteout).arg(plugname);
     }
 
-    QSettings settings;
-    settings.beginGroup("Analyser");
+    Transform t = getAnalysisTransform(waveFileModel->getSampleRate());
+    m_analysisTransform = t;
 
-    bool precise = false, lowamp = true, onset = true, prune = true;
+    // If we have analysed this audio with these settings before, we
+    // can use the cached results instead of running the plugin. The
+    // key comes from the file, so this works even while the audio is
+    // still being decoded
     
-    std::map<QString, bool &> flags {
-        { "precision-analysis", precise },
-        { "lowamp-analysis", lowamp },
-        { "onset-analysis", onset },
-        { "prune-analysis", prune }
-    };
-
-    auto keyMap = getAnalysisSettings();
-    
-    for (auto p: flags) {
-        auto ki = keyMap.find(p.first);
-        if (ki != keyMap.end()) {
-            p.second = settings.value(ki->first, ki->second).toBool();
-        } else {
-            throw std::logic_error("Internal error: One or more analysis settings keys not found in map: check addAnalyses and getAnalysisSettings");
-        }
+    AnalysisCache *cache = AnalysisCache::getInstance();
+    QString key = cache->getKey(m_fileModel, t);
+    ModelId cachedPitch, cachedNotes;
+    if (cache->retrieve(key, cachedPitch, cachedNotes)) {
+        return addCachedAnalyses(cachedPitch, cachedNotes);
     }
 
-    settings.endGroup();
-
-    Transform t = tf->getDefaultTransformFor
-        (base + f0out, waveFileModel->getSampleRate());
-    t.setStepSize(256);
-    t.setBlockSize(2048);
-
-    if (precise) {
-        cerr << "setting parameters for precise mode" << endl;
-        t.setParameter("precisetime", 1);
-    } else {
-        cerr << "setting parameters for vague mode" << endl;
-        t.setParameter("precisetime", 0);
-    }
-
-    if (lowamp) {
-        cerr << "setting parameters for lowamp suppression" << endl;
-        t.setParameter("lowampsuppression", 0.2f);
-    } else {
-        cerr << "setting parameters for no lowamp suppression" << endl;
-        t.setParameter("lowampsuppression", 0.0f);
-    }
-
-    if (onset) {
-        cerr << "setting parameters for increased onset sensitivity" << endl;
-        t.setParameter("onsetsensitivity", 0.7f);
-    } else {
-        cerr << "setting parameters for non-increased onset sensitivity" << endl;
-        t.setParameter("onsetsensitivity", 0.0f);
-    }
-
-    if (prune) {
-        cerr << "setting parameters for duration pruning" << endl;
-        t.setParameter("prunethresh", 0.1f);
-    } else {
-        cerr << "setting parameters for no duration pruning" << endl;
-        t.setParameter("prunethresh", 0.0f);
-    }
+    m_analysisCacheKey = key;
 
     transforms.push_back(t);
 
@@ -488,47 +605,243 @@ Analyser::addAnalyses()
         m_document->addLayerToView(m_pane, layers[i]);
     }
     
-    ColourDatabase *cdb = ColourDatabase::getInstance();
+    setupPitchLayer(qobject_cast<TimeValueLayer *>(m_layers[PitchTrack]));
+    setupNotesLayer(qobject_cast<FlexiNoteLayer *>(m_layers[Notes]));
+
+    m_previewTimer->start();
     
-    TimeValueLayer *pitchLayer = 
-        qobject_cast<TimeValueLayer *>(m_layers[PitchTrack]);
-    if (pitchLayer) {
-        pitchLayer->setBaseColour(cdb->getColourIndex(tr("Black")));
-        auto params = pitchLayer->getPlayParameters();
-        if (params) {
-            params->setPlayPan(1);
-            params->setPlayGain(0.5);
+    return "";
+}
+
+void
+Analyser::viewportChanged()
+{
+    if (m_analysisTransform.getIdentifier() == "") return;
+    if (getInitialAnalysisCompletion() >= 100) return;
+    
+    // Wait for the view to settle before analysing what it shows
+    m_previewTimer->start();
+}
+
+void
+Analyser::addPreviewAnalysis()
+{
+    // The pYIN pitch track and notes only appear once the whole file
+    // has been analysed, which for a long file means nothing useful
+    // is shown for a long time. So while that analysis runs, we also
+    // analyse the region the user is looking at and show that in
+    // temporary layers. They are replaced wholesale by the full
+    // result when it arrives, so there is nothing to stitch: the
+    // preview only has to be good enough to look at, and the margin
+    // either side of the visible region gives the HMM some context so
+    // its edges are not too far off.
+    
+    if (!m_document || !m_pane) return;
+    if (m_analysisTransform.getIdentifier() == "") return;
+    if (getInitialAnalysisCompletion() >= 100) return;
+
+    auto waveFileModel = ModelById::getAs<WaveFileModel>(m_fileModel);
+    if (!waveFileModel) return;
+
+    sv_samplerate_t rate = waveFileModel->getSampleRate();
+    sv_frame_t fileStart = waveFileModel->getStartFrame();
+    sv_frame_t fileEnd = waveFileModel->getEndFrame();
+    
+    sv_frame_t start = m_pane->getStartFrame();
+    sv_frame_t end = m_pane->getEndFrame();
+    if (start < fileStart) start = fileStart;
+    if (end > fileEnd) end = fileEnd;
+    if (end <= start) return;
+
+    // If the user can see most of the file, a preview would take
+    // nearly as long as the real thing
+    if ((end - start) * 2 > (fileEnd - fileStart)) return;
+
+    for (const auto &p: m_previews) {
+        if (p.start <= start && p.end >= end) return;
+    }
+
+    // A preview that has started runs to the end of its range, even
+    // if we delete its layers (see also reAnalyseSelection), so we
+    // only ever have one running at a time alongside the full
+    // analysis. If the user has moved on meanwhile, we try again for
+    // wherever they are once it is done
+    for (const auto &p: m_previews) {
+        for (Layer *layer: p.layers) {
+            if (layer->getCompletion(m_pane) < 100) {
+                m_previewTimer->start();
+                return;
+            }
         }
-        connect(pitchLayer, SIGNAL(modelCompletionChanged(ModelId)),
-                this, SLOT(layerCompletionChanged(ModelId)));
     }
     
-    FlexiNoteLayer *flexiNoteLayer = 
-        qobject_cast<FlexiNoteLayer *>(m_layers[Notes]);
-    if (flexiNoteLayer) {
-        flexiNoteLayer->setBaseColour(cdb->getColourIndex(tr("Bright Blue")));
-        auto params = flexiNoteLayer->getPlayParameters();
+    const sv_frame_t grid = 256;
+    sv_frame_t margin = sv_frame_t(rate * 2.0);
+    start = std::max(fileStart, ((start - margin) / grid) * grid);
+    end = std::min(fileEnd, end + margin);
+
+    cerr << "Analyser::addPreviewAnalysis: analysing " << start
+         << " -> " << end << " ahead of the full analysis" << endl;
+    
+    Transforms transforms;
+    Transform t = m_analysisTransform;
+    t.setStartTime(RealTime::frame2RealTime(start, rate));
+    t.setDuration(RealTime::frame2RealTime(end - start, rate));
+    transforms.push_back(t);
+    t.setOutput("notes");
+    transforms.push_back(t);
+
+    std::vector<Layer *> layers =
+        m_document->createDerivedLayers(transforms, m_fileModel);
+
+    // Older previews are the least likely to be looked at again
+    while (m_previews.size() >= 3) {
+        removePreviewAnalysis(m_previews.begin());
+    }
+    
+    ColourDatabase *cdb = ColourDatabase::getInstance();
+
+    Preview preview;
+    preview.start = start;
+    preview.end = end;
+    
+    for (Layer *layer: layers) {
+        
+        // Add to the pane directly rather than through the document,
+        // so as not to leave anything on the undo stack
+        m_pane->addLayer(layer);
+        preview.layers.push_back(layer);
+
+        // The layers are still known to the document, so they are
+        // saved with the session if it is saved now; this lets
+        // addAnalyses() recognise them when it is loaded again
+        layer->setPresentationName(previewName);
+        
+        SingleColourLayer *scl = qobject_cast<SingleColourLayer *>(layer);
+        if (qobject_cast<FlexiNoteLayer *>(layer)) {
+            scl->setBaseColour(cdb->getColourIndex(tr("Bright Blue")));
+        } else if (scl) {
+            scl->setBaseColour(cdb->getColourIndex(tr("Black")));
+        }
+
+        auto params = layer->getPlayParameters();
         if (params) {
-            params->setPlayPan(1);
-            params->setPlayGain(0.5);
+            params->setPlayAudible(false);
         }
-        connect(flexiNoteLayer, SIGNAL(modelCompletionChanged(ModelId)),
-                this, SLOT(layerCompletionChanged(ModelId)));
-        connect(flexiNoteLayer, SIGNAL(reAnalyseRegion(sv_frame_t, sv_frame_t, float, float)),
-                this, SLOT(reAnalyseRegion(sv_frame_t, sv_frame_t, float, float)));
-        connect(flexiNoteLayer, SIGNAL(materialiseReAnalysis()),
-                this, SLOT(materialiseReAnalysis()));
     }
+
+    m_previews.push_back(preview);
+
+    // Keep the real layers on top for editing
+    stackLayers();
+}
+
+void
+Analyser::removePreviewAnalysis(std::vector<Preview>::iterator i)
+{
+    for (Layer *layer: i->layers) {
+        if (m_pane) m_pane->removeLayer(layer);
+        if (m_document) m_document->deleteLayer(layer);
+    }
+    m_previews.erase(i);
+}
+
+void
+Analyser::removePreviewAnalyses()
+{
+    m_previewTimer->stop();
+    while (!m_previews.empty()) {
+        removePreviewAnalysis(m_previews.begin());
+    }
+}
+
+QString
+Analyser::addCachedAnalyses(ModelId pitchModel, ModelId noteModel)
+{
+    cerr << "using cached pitch and notes analysis" << endl;
+    
+    m_document->addNonDerivedModel(pitchModel);
+    m_document->addNonDerivedModel(noteModel);
+
+    Layer *pitchLayer = m_document->createLayer(LayerFactory::TimeValues);
+    Layer *notesLayer = m_document->createLayer(LayerFactory::FlexiNotes);
+
+    if (!pitchLayer || !notesLayer) {
+        return "Internal error: Analyser::addCachedAnalyses() failed to create layers";
+    }
+    
+    m_document->setModel(pitchLayer, pitchModel);
+    m_document->setModel(notesLayer, noteModel);
+
+    m_layers[PitchTrack] = pitchLayer;
+    m_layers[Notes] = notesLayer;
+
+    m_document->addLayerToView(m_pane, pitchLayer);
+    m_document->addLayerToView(m_pane, notesLayer);
+    
+    setupPitchLayer(qobject_cast<TimeValueLayer *>(pitchLayer));
+    setupNotesLayer(qobject_cast<FlexiNoteLayer *>(notesLayer));
+
+    // The models are already complete, so we won't be told about
+    // their completion. But the audio may not be, in which case the
+    // layers must be extended to its end again when it is
+    
+    auto waveFileModel = ModelById::get(m_fileModel);
+    if (waveFileModel && !waveFileModel->isReady()) {
+        connect(waveFileModel.get(), SIGNAL(ready(ModelId)),
+                this, SLOT(audioModelReady(ModelId)), Qt::UniqueConnection);
+    }
+    
+    layerCompletionChanged(pitchModel);
     
     return "";
 }
 
+void
+Analyser::setupPitchLayer(TimeValueLayer *pitchLayer)
+{
+    if (!pitchLayer) return;
+
+    ColourDatabase *cdb = ColourDatabase::getInstance();
+    
+    pitchLayer->setBaseColour(cdb->getColourIndex(tr("Black")));
+    auto params = pitchLayer->getPlayParameters();
+    if (params) {
+        params->setPlayPan(1);
+        params->setPlayGain(0.5);
+    }
+    connect(pitchLayer, SIGNAL(modelCompletionChanged(ModelId)),
+            this, SLOT(layerCompletionChanged(ModelId)));
+}
+
+void
+Analyser::setupNotesLayer(FlexiNoteLayer *flexiNoteLayer)
+{
+    if (!flexiNoteLayer) return;
+
+    ColourDatabase *cdb = ColourDatabase::getInstance();
+    
+    flexiNoteLayer->setBaseColour(cdb->getColourIndex(tr("Bright Blue")));
+    auto params = flexiNoteLayer->getPlayParameters();
+    if (params) {
+        params->setPlayPan(1);
+        params->setPlayGain(0.5);
+    }
+    connect(flexiNoteLayer, SIGNAL(modelCompletionChanged(ModelId)),
+            this, SLOT(layerCompletionChanged(ModelId)));
+    connect(flexiNoteLayer, SIGNAL(reAnalyseRegion(sv_frame_t, sv_frame_t, float, float)),
+            this, SLOT(reAnalyseRegion(sv_frame_t, sv_frame_t, float, float)));
+    connect(flexiNoteLayer, SIGNAL(materialiseReAnalysis()),
+            this, SLOT(materialiseReAnalysis()));
+}
+
 void
 Analyser::reAnalyseRegion(sv_frame_t frame0, sv_frame_t frame1, float freq0, float freq1)
 {
     cerr << "Analyser::reAnalyseRegion(" << frame0 << ", " << frame1
          << ", " << freq0 << ", " << freq1 << ")" << endl;
     showPitchCandidates(true);
+    setNextSelections({}); // not stepping through notes
     (void)reAnalyseSelection(Selection(frame0, frame1),
                              FrequencyRange(freq0, freq1));
 }
@@ -537,6 +850,7 @@ void
 Analyser::materialiseReAnalysis()
 {
     if (m_reAnalysingSelection.isEmpty()) return;
+    if (commitPitchCandidate()) return;
     switchPitchCandidate(m_reAnalysingSelection, true); // or false, doesn't matter
 }
 
@@ -561,8 +875,42 @@ Analyser::reAnalyseSelection(Selection sel, FrequencyRange range)
 
     if (m_currentAsyncHandle) {
         m_document->cancelAsyncLayerCreation(m_currentAsyncHandle);
+        m_currentAsyncHandle = 0;
+        m_candidateFramesWasted += m_currentAsyncFrames;
+    }
+
+    if (m_pendingCandidateTransform.getIdentifier() != "") {
+        // Superseded before it was started
+        m_candidateFramesAvoided += m_currentAsyncFrames;
+        m_pendingCandidateTransform = Transform();
     }
 
+    m_currentAsyncFrames = 0;
+    
+    // Foreground work takes precedence over speculative analyses,
+    // but if one of those has already done (or is doing) the work we
+    // want, we can take it over
+    std::vector<Layer *> precomputed;
+    Document::LayerCreationAsyncHandle inFlight = 0;
+    if (!m_speculative.empty()) {
+        if (!range.isConstrained()) {
+            takeSpeculativeAnalysis(sel, precomputed, inFlight);
+        }
+        if (!precomputed.empty() || inFlight) {
+            ++m_speculativeHits;
+        } else {
+            ++m_speculativeMisses;
+        }
+        cerr << "Analyser: speculative candidate analyses used for "
+             << m_speculativeHits << " of "
+             << m_speculativeHits + m_speculativeMisses
+             << " selections that had them" << endl;
+    }
+    discardSpeculativeAnalyses();
+    
+    // A candidate chosen for the previous selection is kept
+    commitPitchCandidate();
+    
     if (!m_reAnalysisCandidates.empty()) {
         CommandHistory::getInstance()->startCompoundOperation
             (tr("Discard Previous Candidates"), true);
@@ -573,12 +921,90 @@ Analyser::reAnalyseSelection(Selection sel, FrequencyRange range)
     m_reAnalysingSelection = sel;
     m_reAnalysingRange = range;
 
-    m_preAnalysis = Clipboard();
+    m_preAnalysis.clear();
     Layer *myLayer = m_layers[PitchTrack];
     if (myLayer) {
-        myLayer->copy(m_pane, sel, m_preAnalysis);
+        m_preAnalysis = RangeTransformCommand::capture
+            (myLayer->getModel(), sel.getStartFrame(), sel.getDuration());
     }
 
+    if (!precomputed.empty()) {
+        cerr << "Analyser::reAnalyseSelection: using speculatively computed candidates" << endl;
+        m_currentAsyncHandle = 0;
+        addCandidateLayers(precomputed);
+        scheduleSpeculativeAnalyses();
+        emit layersChanged();
+        return "";
+    }
+
+    if (inFlight) {
+        // layersCreated() will treat it as ours when it arrives, and
+        // schedule the next neighbours from there
+        cerr << "Analyser::reAnalyseSelection: adopting speculative analysis in progress" << endl;
+        m_currentAsyncHandle = inFlight;
+        m_currentAsyncFrames = sel.getDuration();
+        return "";
+    }
+
+    Transform t;
+    QString error = getCandidateTransform(sel, range, t);
+    if (error != "" || t.getIdentifier() == "") {
+        return error;
+    }
+
+    // Don't start the analysis straight away. During rapid selection
+    // changes (dragging, or stepping through notes) most requests are
+    // superseded within a few tens of milliseconds, and a cancelled
+    // analysis still runs to the end of its range in the background.
+    // Requests that are superseded before the timer fires are never
+    // started at all.
+    
+    m_pendingCandidateTransform = t;
+    m_currentAsyncFrames = sel.getDuration();
+    m_reAnalysisTimer->start();
+
+    return "";
+}
+
+void
+Analyser::startPendingReAnalysis()
+{
+    QMutexLocker locker(&m_asyncMutex);
+
+    Transform t = m_pendingCandidateTransform;
+    m_pendingCandidateTransform = Transform();
+    
+    if (t.getIdentifier() == "" ||
+        m_reAnalysingSelection.isEmpty() ||
+        !m_document) {
+        return;
+    }
+    
+    Transforms transforms;
+    transforms.push_back(t);
+    
+    m_currentAsyncHandle =
+        m_document->createDerivedLayersAsync(transforms, m_fileModel, this);
+
+    m_candidateFramesStarted += m_currentAsyncFrames;
+
+    cerr << "Analyser: candidate analysis frames started "
+         << m_candidateFramesStarted << ", wasted on superseded analyses "
+         << m_candidateFramesWasted << ", avoided by coalescing "
+         << m_candidateFramesAvoided << endl;
+}
+
+QString
+Analyser::getCandidateTransform(Selection sel, FrequencyRange range,
+                                Transform &t)
+{
+    t = Transform();
+    
+    auto waveFileModel = ModelById::getAs<WaveFileModel>(m_fileModel);
+    if (!waveFileModel) {
+        return "Internal error: Analyser::getCandidateTransform() called with no model present";
+    }
+    
     TransformFactory *tf = TransformFactory::getInstance();
     
     QString plugname1 = "pYIN";
@@ -592,22 +1018,20 @@ Analyser::reAnalyseSelection(Selection sel, FrequencyRange range)
         out = "peak";
     }
 
-    Transforms transforms;
-
     QString notFound = tr("Transform \"%1\" not found. Unable to perform interactive analysis.<br><br>Are the %2 and %3 Vamp plugins correctly installed?");
     if (!tf->haveTransform(base + out)) {
 	return notFound.arg(base + out).arg(plugname1).arg(plugname2);
     }
 
-    Transform t = tf->getDefaultTransformFor
+    Transform candidate = tf->getDefaultTransformFor
         (base + out, waveFileModel->getSampleRate());
-    t.setStepSize(256);
-    t.setBlockSize(2048);
+    candidate.setStepSize(256);
+    candidate.setBlockSize(2048);
 
     if (range.isConstrained()) {
-        t.setParameter("minfreq", float(range.min));
-        t.setParameter("maxfreq", float(range.max));
-        t.setBlockSize(4096);
+        candidate.setParameter("minfreq", float(range.min));
+        candidate.setParameter("maxfreq", float(range.max));
+        candidate.setBlockSize(4096);
     }
 
     // get time stamps that align with the 256-sample grid of the original extraction
@@ -631,22 +1055,133 @@ Analyser::reAnalyseSelection(Selection sel, FrequencyRange range)
         duration = end - start;
     }
 
-    cerr << "Analyser::reAnalyseSelection: start " << start << " end " << end << " original selection start " << sel.getStartFrame() << " end " << sel.getEndFrame() << " duration " << duration << endl;
+    cerr << "Analyser::getCandidateTransform: start " << start << " end " << end << " original selection start " << sel.getStartFrame() << " end " << sel.getEndFrame() << " duration " << duration << endl;
 
     if (duration <= RealTime::zeroTime) {
-        cerr << "Analyser::reAnalyseSelection: duration <= 0, not analysing" << endl;
+        cerr << "Analyser::getCandidateTransform: duration <= 0, not analysing" << endl;
         return "";
     }
     
-    t.setStartTime(start);
-    t.setDuration(duration);
+    candidate.setStartTime(start);
+    candidate.setDuration(duration);
 
-    transforms.push_back(t);
+    t = candidate;
+    return "";
+}
+
+void
+Analyser::scheduleSpeculativeAnalyses()
+{
+    // Called with m_asyncMutex held, once the candidates for the
+    // current selection have arrived. Start analyses for the
+    // selections given to setNextSelections(), in the expectation
+    // that the user will step to one of them next. These are
+    // discarded as soon as any foreground analysis starts that does
+    // not want them.
     
-    m_currentAsyncHandle =
-        m_document->createDerivedLayersAsync(transforms, m_fileModel, this);
+    if (m_reAnalysingSelection.isEmpty() ||
+        m_reAnalysingRange.isConstrained()) {
+        return;
+    }
+    
+    Transform current;
+    (void)getCandidateTransform(m_reAnalysingSelection, FrequencyRange(),
+                                current);
+    
+    for (const Selection &sel: m_nextSelections) {
 
-    return "";
+        if (sel.isEmpty()) continue;
+        
+        Transform t;
+        if (getCandidateTransform(sel, FrequencyRange(), t) != "" ||
+            t.getIdentifier() == "" ||
+            isSameCandidateRange(t, current)) {
+            continue;
+        }
+
+        bool have = false;
+        for (const auto &s: m_speculative) {
+            if (isSameCandidateRange(s.transform, t)) have = true;
+        }
+        if (have) continue;
+
+        cerr << "Analyser::scheduleSpeculativeAnalyses: starting analysis of "
+             << sel.getStartFrame() << " -> " << sel.getEndFrame() << endl;
+
+        Transforms transforms;
+        transforms.push_back(t);
+
+        SpeculativeAnalysis s;
+        s.selection = sel;
+        s.transform = t;
+        s.handle = m_document->createDerivedLayersAsync
+            (transforms, m_fileModel, this);
+        m_speculative.push_back(s);
+    }
+}
+
+void
+Analyser::setNextSelections(const std::vector<Selection> &selections)
+{
+    QMutexLocker locker(&m_asyncMutex);
+    m_nextSelections = selections;
+}
+
+bool
+Analyser::isSameCandidateRange(const Transform &t1, const Transform &t2)
+{
+    // The analysed range is aligned to the pitch-track grid, so
+    // selections that differ by less than a grid step (such as one
+    // ending at a note's last frame and one ending just after it)
+    // share an analysis
+    return (t1.getIdentifier() != "" &&
+            t1.getIdentifier() == t2.getIdentifier() &&
+            t1.getStartTime() == t2.getStartTime() &&
+            t1.getDuration() == t2.getDuration());
+}
+
+void
+Analyser::takeSpeculativeAnalysis(Selection sel,
+                                  std::vector<Layer *> &layers,
+                                  Document::LayerCreationAsyncHandle &handle)
+{
+    // Called with m_asyncMutex held
+    
+    layers.clear();
+    handle = 0;
+    
+    Transform t;
+    if (getCandidateTransform(sel, FrequencyRange(), t) != "" ||
+        t.getIdentifier() == "") {
+        return;
+    }
+    
+    for (auto i = m_speculative.begin(); i != m_speculative.end(); ++i) {
+        if (isSameCandidateRange(i->transform, t)) {
+            layers = i->layers;
+            handle = i->handle;
+            m_speculative.erase(i);
+            return;
+        }
+    }
+}
+
+void
+Analyser::discardSpeculativeAnalyses()
+{
+    // Called with m_asyncMutex held
+    
+    for (const auto &s: m_speculative) {
+        if (s.handle) {
+            m_document->cancelAsyncLayerCreation(s.handle);
+            m_candidateFramesWasted += s.selection.getDuration();
+        }
+        for (Layer *layer: s.layers) {
+            m_document->deleteLayer(layer);
+        }
+    }
+
+    m_speculative.clear();
 }
 
 bool
@@ -683,61 +1218,79 @@ Analyser::layersCreated(Document::LayerCreationAsyncHandle handle,
     {
         QMutexLocker locker(&m_asyncMutex);
 
+        vector<Layer *> all;
+        for (int i = 0; i < (int)primary.size(); ++i) {
+            all.push_back(primary[i]);
+        }
+        for (int i = 0; i < (int)additional.size(); ++i) {
+            all.push_back(additional[i]);
+        }
+
+        for (auto &s: m_speculative) {
+            if (handle == s.handle) {
+                // Hold on to these (outside any view) until the
+                // selection they belong to arrives, or until we
+                // discard them
+                s.handle = 0;
+                s.layers = all;
+                return;
+            }
+        }
+        
         if (handle != m_currentAsyncHandle || 
             m_reAnalysingSelection == Selection()) {
             // We don't want these!
-            for (int i = 0; i < (int)primary.size(); ++i) {
-                m_document->deleteLayer(primary[i]);
-            }
-            for (int i = 0; i < (int)additional.size(); ++i) {
-                m_document->deleteLayer(additional[i]);
+            for (int i = 0; i < (int)all.size(); ++i) {
+                m_document->deleteLayer(all[i]);
             }
             return;
         }
         m_currentAsyncHandle = 0;
 
-        CommandHistory::getInstance()->startCompoundOperation
-            (tr("Re-Analyse Selection"), true);
+        addCandidateLayers(all);
 
-        m_reAnalysisCandidates.clear();
+        scheduleSpeculativeAnalyses();
+    }
 
-        vector<Layer *> all;
-        for (int i = 0; i < (int)primary.size(); ++i) {
-            all.push_back(primary[i]);
-        }
-        for (int i = 0; i < (int)additional.size(); ++i) {
-            all.push_back(additional[i]);
-        }
+    emit layersChanged();
+}
 
-        for (int i = 0; i < (int)all.size(); ++i) {
-            TimeValueLayer *t = qobject_cast<TimeValueLayer *>(all[i]);
-            if (t) {
-                auto params = t->getPlayParameters();
-                if (params) {
-                    params->setPlayAudible(false);
-                }
-                t->setBaseColour
-                    (ColourDatabase::getInstance()->getColourIndex(tr("Bright Orange")));
-                t->setPresentationName("candidate");
-                m_document->addLayerToView(m_pane, t);
-                m_reAnalysisCandidates.push_back(t);
-                /*
-                cerr << "New re-analysis candidate model has "
-                     << ((SparseTimeValueModel *)t->getModel())->getAllEvents().size() << " point(s)" << endl;
-                */
-            }
-        }
+void
+Analyser::addCandidateLayers(vector<Layer *> all)
+{
+    // Called with m_asyncMutex held
+    
+    CommandHistory::getInstance()->startCompoundOperation
+        (tr("Re-Analyse Selection"), true);
+
+    m_reAnalysisCandidates.clear();
 
-        if (!all.empty()) {
-            bool show = m_candidatesVisible;
-            m_candidatesVisible = !show; // to ensure the following takes effect
-            showPitchCandidates(show);
+    for (int i = 0; i < (int)all.size(); ++i) {
+        TimeValueLayer *t = qobject_cast<TimeValueLayer *>(all[i]);
+        if (t) {
+            auto params = t->getPlayParameters();
+            if (params) {
+                params->setPlayAudible(false);
+            }
+            t->setBaseColour
+                (ColourDatabase::getInstance()->getColourIndex(tr("Bright Orange")));
+            t->setPresentationName("candidate");
+            m_document->addLayerToView(m_pane, t);
+            m_reAnalysisCandidates.push_back(t);
+            /*
+            cerr << "New re-analysis candidate model has "
+                 << ((SparseTimeValueModel *)t->getModel())->getAllEvents().size() << " point(s)" << endl;
+            */
         }
+    }
 
-        CommandHistory::getInstance()->endCompoundOperation();
+    if (!all.empty()) {
+        bool show = m_candidatesVisible;
+        m_candidatesVisible = !show; // to ensure the following takes effect
+        showPitchCandidates(show);
     }
 
-    emit layersChanged();
+    CommandHistory::getInstance()->endCompoundOperation();
 }
 
 bool
@@ -756,10 +1309,8 @@ Analyser::haveLowerPitchCandidate() const
 }    
 
 void
-Analyser::switchPitchCandidate(Selection sel, bool up)
+Analyser::cycleCandidate(bool up)
 {
-    if (m_reAnalysisCandidates.empty()) return;
-
     if (up) {
         m_currentCandidate = m_currentCandidate + 1;
         if (m_currentCandidate >= (int)m_reAnalysisCandidates.size()) {
@@ -771,16 +1322,99 @@ Analyser::switchPitchCandidate(Selection sel, bool up)
             m_currentCandidate = (int)m_reAnalysisCandidates.size() - 1;
         }
     }
+}
+
+void
+Analyser::switchPitchCandidate(Selection sel, bool up)
+{
+    if (m_reAnalysisCandidates.empty()) return;
+
+    cycleCandidate(up);
+    highlightPitchCandidate();
+    applyPitchCandidate(sel);
+
+    stackLayers();
+}
+
+void
+Analyser::choosePitchCandidate(const MultiSelection::SelectionList &selections,
+                               bool up)
+{
+    if (m_reAnalysisCandidates.empty()) return;
+
+    // Only the highlight changes here. The pitch track is left alone
+    // until commitPitchCandidate(), so stepping through the
+    // candidates costs the same however long the selection is
+    
+    cycleCandidate(up);
+    highlightPitchCandidate();
+    m_chosenSelections = selections;
+}
+
+bool
+Analyser::commitPitchCandidate()
+{
+    if (m_chosenSelections.empty()) return false;
+
+    MultiSelection::SelectionList selections = m_chosenSelections;
+    m_chosenSelections.clear();
 
+    if (m_currentCandidate < 0 ||
+        m_currentCandidate >= (int)m_reAnalysisCandidates.size()) {
+        return false;
+    }
+
+    CommandHistory::getInstance()->startCompoundOperation
+        (tr("Choose Pitch Candidate"), true);
+
+    for (const Selection &sel: selections) {
+        applyPitchCandidate(sel);
+    }
+    snapNotesToPitchTrack(selections);
+
+    CommandHistory::getInstance()->endCompoundOperation();
+
+    stackLayers();
+    return true;
+}
+
+void
+Analyser::applyPitchCandidate(Selection sel)
+{
     Layer *pitchTrack = m_layers[PitchTrack];
     if (!pitchTrack) return;
 
-    Clipboard clip;
-    pitchTrack->deleteSelection(sel);
-    m_reAnalysisCandidates[m_currentCandidate]->copy(m_pane, sel, clip);
-    pitchTrack->paste(m_pane, clip, 0, false);
+    auto candidateModel = ModelById::getAs<SparseTimeValueModel>
+        (m_reAnalysisCandidates[m_currentCandidate]->getModel());
+    if (!candidateModel) return;
 
-    stackLayers();
+    // Swap the candidate's events into the selection directly, as
+    // one command, rather than by deleting, copying to a clipboard
+    // and pasting back through the layer
+
+    addPitchTrackCommand(new RangeTransformCommand
+                         (pitchTrack->getModel(),
+                          sel.getStartFrame(), sel.getDuration(),
+                          candidateModel->getEventsWithin
+                          (sel.getStartFrame(), sel.getDuration()),
+                          tr("Choose Pitch Candidate")));
+}
+
+void
+Analyser::highlightPitchCandidate()
+{
+    ColourDatabase *cdb = ColourDatabase::getInstance();
+    
+    for (int i = 0; i < (int)m_reAnalysisCandidates.size(); ++i) {
+        TimeValueLayer *t = qobject_cast<TimeValueLayer *>
+            (m_reAnalysisCandidates[i]);
+        if (!t) continue;
+        if (i == m_currentCandidate) {
+            t->setBaseColour(cdb->getColourIndex(tr("Bright Red")));
+        } else {
+            t->setBaseColour(cdb->getColourIndex(tr("Bright Orange")));
+        }
+    }
 }
 
 void
@@ -798,31 +1432,14 @@ Analyser::stackLayers()
 void
 Analyser::shiftOctave(Selection sel, bool up)
 {
-    float factor = (up ? 2.f : 0.5f);
-    
-    vector<Layer *> actOn;
-
     Layer *pitchTrack = m_layers[PitchTrack];
-    if (pitchTrack) actOn.push_back(pitchTrack);
+    if (!pitchTrack) return;
 
-    foreach (Layer *layer, actOn) {
-        
-        Clipboard clip;
-        layer->copy(m_pane, sel, clip);
-        layer->deleteSelection(sel);
-
-        Clipboard shifted;
-        foreach (Event e, clip.getPoints()) {
-            if (e.hasValue()) {
-                Event se = e.withValue(e.getValue() * factor);
-                shifted.addPoint(se);
-            } else {
-                shifted.addPoint(e);
-            }
-        }
-        
-        layer->paste(m_pane, shifted, 0, false);
-    }
+    addPitchTrackCommand(new RangeTransformCommand
+                         (pitchTrack->getModel(),
+                          sel.getStartFrame(), sel.getDuration(),
+                          up ? 2.f : 0.5f,
+                          up ? tr("Shift Octave Up") : tr("Shift Octave Down")));
 }
 
 void
@@ -831,7 +1448,10 @@ Analyser::deletePitches(Selection sel)
     Layer *pitchTrack = m_layers[PitchTrack];
     if (!pitchTrack) return;
 
-    pitchTrack->deleteSelection(sel);
+    addPitchTrackCommand(new RangeTransformCommand
+                         (pitchTrack->getModel(),
+                          sel.getStartFrame(), sel.getDuration(),
+                          tr("Delete Pitches")));
 }
 
 void
@@ -843,16 +1463,109 @@ Analyser::abandonReAnalysis(Selection sel)
 
     Layer *myLayer = m_layers[PitchTrack];
     if (!myLayer) return;
-    myLayer->deleteSelection(sel);
-    myLayer->paste(m_pane, m_preAnalysis, 0, false);
+
+    addPitchTrackCommand(new RangeTransformCommand
+                         (myLayer->getModel(),
+                          sel.getStartFrame(), sel.getDuration(),
+                          m_preAnalysis,
+                          tr("Restore Pitches")));
 }    
 
+void
+Analyser::addPitchTrackCommand(RangeTransformCommand *command)
+{
+    if (command->isEmpty()) {
+        delete command;
+        return;
+    }
+    CommandHistory::getInstance()->addCommand(command);
+}
+
+void
+Analyser::snapNotesToPitchTrack(const MultiSelection::SelectionList &selections)
+{
+    Layer *notesLayer = m_layers[Notes];
+    if (!notesLayer) return;
+
+    auto notes = ModelById::getAs<NoteModel>(notesLayer->getModel());
+    if (!notes) return;
+
+    PitchTrackIndex *index = getPitchTrackIndex();
+    if (!index) return;
+
+    // If we are within a ModelTransaction, the index will not have
+    // heard about any changes made to the pitch track so far
+    auto pitches = ModelById::get(index->getModel());
+    bool stale = (pitches && pitches->signalsBlocked());
+
+    // Merge overlapping selections, so that no note is looked at
+    // twice. The list is already ordered by start frame
+    vector<Selection> merged;
+    for (const Selection &sel: selections) {
+        if (sel.isEmpty()) continue;
+        if (!merged.empty() &&
+            sel.getStartFrame() <= merged.rbegin()->getEndFrame()) {
+            Selection &prev = *merged.rbegin();
+            prev = Selection(prev.getStartFrame(),
+                             std::max(prev.getEndFrame(), sel.getEndFrame()));
+        } else {
+            merged.push_back(sel);
+        }
+    }
+
+    ChangeEventsCommand *command = new ChangeEventsCommand
+        (notesLayer->getModel().untyped, tr("Snap Notes"));
+
+    for (const Selection &sel: merged) {
+
+        EventVector toSnap = notes->getEventsStartingWithin
+            (sel.getStartFrame(), sel.getDuration());
+
+        if (stale && !toSnap.empty()) {
+            sv_frame_t end = sel.getEndFrame();
+            for (const auto &note: toSnap) {
+                end = std::max(end, note.getFrame() + note.getDuration());
+            }
+            index->refresh(toSnap.begin()->getFrame(), end);
+        }
+
+        for (const auto &note: toSnap) {
+
+            // The median is the mean of the middle two for an even
+            // count. A note with no pitches under it is removed, as
+            // in FlexiNoteLayer::snapSelectedNotesToPitchTrack
+            
+            double median = 0.0;
+            if (!index->getMedian(note.getFrame(), note.getDuration(),
+                                  median)) {
+                command->remove(note);
+                continue;
+            }
+
+            if (float(median) != note.getValue()) {
+                command->remove(note);
+                command->add(note.withValue(float(median)));
+            }
+        }
+    }
+
+    Command *c = command->finish();
+    if (c) CommandHistory::getInstance()->addCommand(c, false);
+}
+
 void
 Analyser::clearReAnalysis()
 {
+    commitPitchCandidate();
     discardPitchCandidates();
 }
 
+void
+Analyser::discardPitchCandidateChoice()
+{
+    m_chosenSelections.clear();
+}
+
 void
 Analyser::discardPitchCandidates()
 {
@@ -868,6 +1581,7 @@ Analyser::discardPitchCandidates()
     }
 
     m_currentCandidate = -1;
+    m_chosenSelections.clear();
     m_reAnalysingSelection = Selection();
     m_candidatesVisible = false;
 }
@@ -889,58 +1603,102 @@ Analyser::layerAboutToBeDeleted(Layer *doomed)
 }
 
 void
-Analyser::takePitchTrackFrom(Layer *otherLayer)
+Analyser::takePitchTrackFrom(ModelId otherModelId)
 {
     Layer *myLayer = m_layers[PitchTrack];
-    if (!myLayer || !otherLayer) return;
+    if (!myLayer) return;
 
     auto myModel = ModelById::get(myLayer->getModel());
-    auto otherModel = ModelById::get(otherLayer->getModel());
+    auto otherModel = ModelById::getAs<SparseTimeValueModel>(otherModelId);
     if (!myModel || !otherModel) return;
 
-    Clipboard clip;
-    
-    Selection sel = Selection(myModel->getStartFrame(),
-                              myModel->getEndFrame());
-    myLayer->deleteSelection(sel);
-
-    sel = Selection(otherModel->getStartFrame(),
-                    otherModel->getEndFrame());
-    otherLayer->copy(m_pane, sel, clip);
-
     // Remove all pitches <= 0Hz -- we now save absent pitches as 0Hz
     // values when exporting a pitch track, so we need to exclude them
     // here when importing again
+    EventVector all = otherModel->getAllEvents();
     EventVector after;
+    after.reserve(all.size());
     int excl = 0;
-    for (const auto &p: clip.getPoints()) {
+    for (const auto &p: all) {
         if (p.hasValue() && p.getValue() > 0.f) {
             after.push_back(p);
         } else {
             ++excl;
         }
     }
-    clip.setPoints(after);
+    all.clear();
+
+    SVDEBUG << "Analyser::takePitchTrackFrom: taking " << after.size()
+            << " pitches, excluding " << excl << " unvoiced" << endl;
+
+    // Replace everything in one command, covering the extents of
+    // both the old and new pitch tracks
+    sv_frame_t start = std::min(myModel->getStartFrame(),
+                                otherModel->getStartFrame());
+    sv_frame_t end = std::max(myModel->getEndFrame(),
+                              otherModel->getEndFrame());
+
+    addPitchTrackCommand(new RangeTransformCommand
+                         (myLayer->getModel(), start, end - start + 1,
+                          after, tr("Import Pitch Track")));
+}
+
+PitchTrackIndex *
+Analyser::getPitchTrackIndex()
+{
+    Layer *pitchTrack = m_layers[PitchTrack];
+    if (!pitchTrack) return 0;
+
+    if (m_pitchIndex->getModel() != pitchTrack->getModel()) {
+        m_pitchIndex->setModel(pitchTrack->getModel());
+    }
 
-    myLayer->paste(m_pane, clip, 0, false);
+    return m_pitchIndex;
+}
+
+const NoteBoundaryIndex *
+Analyser::getNoteBoundaryIndex()
+{
+    Layer *notes = m_layers[Notes];
+    if (!notes) return 0;
+
+    // The notes layer, or its model, may have been replaced since we
+    // last looked
+    if (m_noteIndex->getModel() != notes->getModel()) {
+        m_noteIndex->setModel(notes->getModel());
+    }
+
+    return m_noteIndex;
 }
 
 void
 Analyser::getEnclosingSelectionScope(sv_frame_t f, sv_frame_t &f0, sv_frame_t &f1)
 {
-    FlexiNoteLayer *flexiNoteLayer = 
-        qobject_cast<FlexiNoteLayer *>(m_layers[Notes]);
+    const NoteBoundaryIndex *index = getNoteBoundaryIndex();
 
-    sv_frame_t f0i = f, f1i = f;
-    int res = 1;
-
-    if (!flexiNoteLayer) {
+    if (!index) {
         f0 = f1 = f;
         return;
     }
-    
-    flexiNoteLayer->snapToFeatureFrame(m_pane, f0i, res, Layer::SnapLeft, -1);
-    flexiNoteLayer->snapToFeatureFrame(m_pane, f1i, res, Layer::SnapRight, -1);
+
+    // Same scope as FlexiNoteLayer::snapToFeatureFrame gives: from the
+    // start of the last note starting before f, to whichever is
+    // nearer of the end of that note (if it extends past f) and the
+    // start of the next note
+
+    sv_frame_t leftStart = 0, leftEnd = 0, rightStart = 0, rightEnd = 0;
+    bool haveLeft = index->getNoteBefore(f, leftStart, leftEnd);
+    bool haveRight = index->getNoteAtOrAfter(f, rightStart, rightEnd);
+
+    sv_frame_t f0i = (haveLeft ? leftStart : 0);
+    sv_frame_t f1i = f;
+
+    if (haveLeft && leftEnd > f &&
+        (!haveRight || leftEnd - f < rightStart - f)) {
+        f1i = leftEnd;
+    } else if (haveRight) {
+        f1i = rightStart;
+    }
 
     f0 = (f0i < 0 ? 0 : f0i);
     f1 = (f1i < 0 ? 0 : f1i);
@@ -25,14 +25,18 @@
 
 #include "framework/Document.h"
 #include "base/Selection.h"
-#include "base/Clipboard.h"
 #include "data/model/WaveFileModel.h"
+#include "transform/Transform.h"
+#include "RangeTransformCommand.h"
 
 class Pane;
 class PaneStack;
+class QTimer;
 class Layer;
 class TimeValueLayer;
-class Layer;
+class FlexiNoteLayer;
+class NoteBoundaryIndex;
+class PitchTrackIndex;
 
 class Analyser : public QObject,
                  public Document::LayerCreationHandler
@@ -109,6 +113,13 @@ public:
 
     void getEnclosingSelectionScope(sv_frame_t f, sv_frame_t &f0, sv_frame_t &f1);
 
+    /**
+     * Return an index of the note boundaries in the current notes
+     * layer, kept up to date as the notes change, or 0 if there is
+     * no notes layer.
+     */
+    const NoteBoundaryIndex *getNoteBoundaryIndex();
+
     struct FrequencyRange {
         FrequencyRange() : min(0), max(0) { }
         FrequencyRange(double min_, double max_) : min(min_), max(max_) { }
@@ -126,6 +137,14 @@ public:
      * group in QSettings.
      */
     static std::map<QString, QVariant> getAnalysisSettings();
+
+    /**
+     * Return the pYIN transform for the smoothed pitch track output,
+     * with its parameters set from the current analysis settings.
+     * The note transform is the same, with the output changed to
+     * "notes".
+     */
+    static Transform getAnalysisTransform(sv_samplerate_t sampleRate);
     
     /**
      * Analyse the selection and schedule asynchronous adds of
@@ -136,6 +155,16 @@ public:
      */
     QString reAnalyseSelection(Selection sel, FrequencyRange range);
 
+    /**
+     * Set the selections the user is likely to make next (those the
+     * select-one-note actions would make from the current one). Once
+     * the candidates for the current selection have arrived, these
+     * are analysed in the background, so that stepping to one of
+     * them finds its candidates ready. Call before
+     * reAnalyseSelection.
+     */
+    void setNextSelections(const std::vector<Selection> &);
+
     /**
      * Return true if the analysed pitch candidates are currently
      * visible (they are hidden from the call to reAnalyseSelection
@@ -160,10 +189,37 @@ public:
     /**
      * If a re-analysis has been activated, switch the selected area
      * of the main pitch track to a different candidate from the
-     * analysis results.
+     * analysis results. This adds a single command that replaces the
+     * pitch-track events within the selection with those of the
+     * candidate.
      */
     void switchPitchCandidate(Selection sel, bool up);
 
+    /**
+     * If a re-analysis has been activated, highlight a different
+     * candidate from the analysis results as the one to use for the
+     * given selections, without changing the pitch track. The choice
+     * is applied by commitPitchCandidate(), which happens
+     * automatically when the selection changes or the re-analysis is
+     * materialised or cleared, and is dropped if the re-analysis is
+     * abandoned.
+     */
+    void choosePitchCandidate(const MultiSelection::SelectionList &, bool up);
+
+    /**
+     * Apply any candidate chosen with choosePitchCandidate() to the
+     * pitch track, snapping the notes in the chosen selections to
+     * it, as a single command. Return true if there was a choice to
+     * apply.
+     */
+    bool commitPitchCandidate();
+
+    /**
+     * Forget any candidate chosen with choosePitchCandidate()
+     * without applying it.
+     */
+    void discardPitchCandidateChoice();
+
     /**
      * Return true if it is possible to switch up to another pitch
      * candidate. This may mean that the currently selected pitch
@@ -194,6 +250,14 @@ public:
      */
     void shiftOctave(Selection sel, bool up);
 
+    /**
+     * Set the value of each note starting within any of the given
+     * selections to the median of the pitch track over the note's
+     * extent, removing notes that have no pitch track under them.
+     * This adds a single command, however many selections there are.
+     */
+    void snapNotesToPitchTrack(const MultiSelection::SelectionList &);
+
     /**
      * Remove any re-analysis layers and also reset the pitch track in
      * the given selection to its state prior to the last re-analysis,
@@ -212,10 +276,12 @@ public:
     void clearReAnalysis();
 
     /**
-     * Import the pitch track from the given layer into our
-     * pitch-track layer.
+     * Replace the contents of our pitch-track layer with the pitch
+     * track in the given model, which must be a SparseTimeValueModel.
+     * Points with no value or a value of 0Hz or below are skipped.
+     * The caller retains ownership of the model.
      */
-    void takePitchTrackFrom(Layer *layer);
+    void takePitchTrackFrom(ModelId model);
 
     Pane *getPane() {
         return m_pane;
@@ -232,8 +298,12 @@ signals:
 protected slots:
     void layerAboutToBeDeleted(Layer *);
     void layerCompletionChanged(ModelId);
+    void audioModelReady(ModelId);
     void reAnalyseRegion(sv_frame_t, sv_frame_t, float, float);
     void materialiseReAnalysis();
+    void startPendingReAnalysis();
+    void viewportChanged();
+    void addPreviewAnalysis();
 
 protected:
     Document *m_document;
@@ -243,24 +313,96 @@ protected:
 
     mutable std::map<Component, Layer *> m_layers;
 
-    Clipboard m_preAnalysis;
+    // Pitch track within m_reAnalysingSelection before re-analysis
+    RangeTransformCommand::PointVector m_preAnalysis;
     Selection m_reAnalysingSelection;
     FrequencyRange m_reAnalysingRange;
     std::vector<Layer *> m_reAnalysisCandidates;
+    Transform m_analysisTransform;
     int m_currentCandidate;
+    MultiSelection::SelectionList m_chosenSelections; // not yet committed
     bool m_candidatesVisible;
+    QString m_analysisCacheKey; // to store the analysis under, when done
     Document::LayerCreationAsyncHandle m_currentAsyncHandle;
+    sv_frame_t m_currentAsyncFrames;
+    Transform m_pendingCandidateTransform;
     QMutex m_asyncMutex;
 
+    // Audio frames covered by candidate analyses that were started;
+    // that were started and then superseded (an upper bound on the
+    // work thrown away, since we don't know how far they got); and
+    // that were superseded before they could be started
+    sv_frame_t m_candidateFramesStarted;
+    sv_frame_t m_candidateFramesWasted;
+    sv_frame_t m_candidateFramesAvoided;
+    QTimer *m_reAnalysisTimer;
+
+    struct SpeculativeAnalysis {
+        SpeculativeAnalysis() : handle(0) { }
+        Selection selection;
+        Transform transform;
+        Document::LayerCreationAsyncHandle handle; // 0 once complete
+        std::vector<Layer *> layers; // not in any view
+    };
+    std::vector<SpeculativeAnalysis> m_speculative;
+    std::vector<Selection> m_nextSelections;
+
+    // Selections arriving while speculative analyses were running
+    // whose candidates were, or were not, among them
+    int m_speculativeHits;
+    int m_speculativeMisses;
+
+    struct Preview {
+        sv_frame_t start;
+        sv_frame_t end;
+        std::vector<Layer *> layers; // in m_pane, but not via Document
+    };
+    std::vector<Preview> m_previews;
+    QTimer *m_previewTimer;
+
+    NoteBoundaryIndex *m_noteIndex;
+    PitchTrackIndex *m_pitchIndex;
+
     QString doAllAnalyses(bool withPitchTrack);
 
     QString addVisualisations();
     QString addWaveform();
     QString addAnalyses();
+    QString addCachedAnalyses(ModelId pitchModel, ModelId noteModel);
 
+    void setupPitchLayer(TimeValueLayer *);
+    void setupNotesLayer(FlexiNoteLayer *);
+
+    QString getCandidateTransform(Selection sel, FrequencyRange range,
+                                  Transform &t);
+    void addCandidateLayers(std::vector<Layer *>);
     void discardPitchCandidates();
+    void cycleCandidate(bool up);
+    void highlightPitchCandidate();
+    void applyPitchCandidate(Selection sel);
+
+    void scheduleSpeculativeAnalyses();
+    static bool isSameCandidateRange(const Transform &, const Transform &);
+
+    // Remove from the speculative analyses any that covers the same
+    // range as sel would, returning either its layers, if complete,
+    // or its handle, if not
+    void takeSpeculativeAnalysis(Selection sel,
+                                 std::vector<Layer *> &layers,
+                                 Document::LayerCreationAsyncHandle &handle);
+    void discardSpeculativeAnalyses();
+
+    void removePreviewAnalysis(std::vector<Preview>::iterator);
+    void removePreviewAnalyses();
 
     void stackLayers();
+    void extendAnalysisLayers();
+
+    PitchTrackIndex *getPitchTrackIndex();
+
+    // Execute the given command on the pitch track and add it to
+    // the history, or delete it if it would change nothing
+    void addPitchTrackCommand(RangeTransformCommand *);
     
     // Document::LayerCreationHandler method
     void layersCreated(Document::LayerCreationAsyncHandle,
@@ -0,0 +1,336 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "AnalysisCache.h"
+
+#include "data/model/WaveFileModel.h"
+#include "data/model/WritableWaveFileModel.h"
+#include "data/model/SparseTimeValueModel.h"
+#include "data/model/NoteModel.h"
+#include "base/Debug.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QSettings>
+#include <QStandardPaths>
+#include <QUrl>
+
+static const quint32 cacheMagic = 0x544f4e43; // "TONC"
+static const qint32 cacheVersion = 2;
+
+AnalysisCache *
+AnalysisCache::getInstance()
+{
+    static AnalysisCache instance;
+    return &instance;
+}
+
+AnalysisCache::AnalysisCache() :
+    m_hits(0),
+    m_misses(0),
+    m_evictions(0)
+{
+}
+
+QString
+AnalysisCache::getDirectory() const
+{
+    QString dir = QStandardPaths::writableLocation
+        (QStandardPaths::CacheLocation);
+    if (dir == "") return "";
+    dir = QDir(dir).filePath("analysis");
+    if (!QDir().mkpath(dir)) return "";
+    return dir;
+}
+
+qint64
+AnalysisCache::getSizeLimit() const
+{
+    QSettings settings;
+    settings.beginGroup("Analyser");
+    int mb = settings.value("analysis-cache-limit-mb", 256).toInt();
+    settings.endGroup();
+    if (mb < 0) mb = 0;
+    return qint64(mb) * 1024 * 1024;
+}
+
+QString
+AnalysisCache::getKey(ModelId audioModel, const Transform &transform)
+{
+    if (getSizeLimit() == 0) return "";
+
+    auto model = ModelById::getAs<WaveFileModel>(audioModel);
+    if (!model || !model->isOK()) return "";
+
+    // A recording is still being written, so its file is no guide to
+    // the audio we will end up analysing
+    if (ModelById::isa<WritableWaveFileModel>(audioModel)) return "";
+
+    // Fingerprint the file rather than the decoded audio. Decoding
+    // (and reading back) an hour of audio takes seconds, and for a
+    // compressed file it is not finished when we need the key. The
+    // file's path, size and modification time, together with blocks
+    // sampled through it, identify it well enough for a cache that
+    // only ever saves us an analysis
+
+    QString location = model->getLocation();
+    QFileInfo info(location);
+    if (!info.isFile()) {
+        info = QFileInfo(QUrl(location).toLocalFile());
+    }
+    if (!info.isFile()) {
+        SVDEBUG << "AnalysisCache::getKey: audio location \"" << location
+                << "\" is not a local file, not using cache" << endl;
+        return "";
+    }
+
+    QFile file(info.absoluteFilePath());
+    if (!file.open(QIODevice::ReadOnly)) return "";
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+
+    qint64 size = file.size();
+    QByteArray header = QString("%1:%2:%3:%4:%5")
+        .arg(info.canonicalFilePath())
+        .arg(size)
+        .arg(info.lastModified().toMSecsSinceEpoch())
+        .arg(model->getSampleRate())
+        .arg(model->getChannelCount())
+        .toUtf8();
+    hash.addData(header);
+
+    const qint64 blockSize = 4096;
+    const int blockCount = 16;
+    for (int i = 0; i < blockCount; ++i) {
+        qint64 offset = 0;
+        if (size > blockSize) {
+            offset = ((size - blockSize) / (blockCount - 1)) * i;
+        }
+        if (!file.seek(offset)) break;
+        hash.addData(file.read(blockSize));
+        if (size <= blockSize) break;
+    }
+
+    file.close();
+
+    // The transform XML covers plugin version, step and block size,
+    // sample rate and all parameters. The output is excluded because
+    // one entry holds both pitch track and notes
+
+    Transform t(transform);
+    t.setOutput("");
+    hash.addData(t.toXmlString().toUtf8());
+
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+bool
+AnalysisCache::retrieve(QString key, ModelId &pitchModelId, ModelId &noteModelId)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (key == "") return false;
+
+    QString dir = getDirectory();
+    if (dir == "") return false;
+
+    QString path = QDir(dir).filePath(key);
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        ++m_misses;
+        SVDEBUG << "AnalysisCache: miss for " << key << " (hits "
+                << m_hits << ", misses " << m_misses << ")" << endl;
+        return false;
+    }
+
+    QDataStream stream(&file);
+
+    quint32 magic = 0;
+    qint32 version = 0;
+    stream >> magic >> version;
+    if (magic != cacheMagic || version != cacheVersion) {
+        SVDEBUG << "AnalysisCache: entry " << key
+                << " has wrong magic or version, discarding it" << endl;
+        file.close();
+        file.remove();
+        ++m_misses;
+        return false;
+    }
+
+    double sampleRate = 0;
+    qint32 resolution = 0;
+    QString units;
+    qint64 count = 0;
+
+    stream >> sampleRate >> resolution >> units >> count;
+
+    auto pitchModel = std::make_shared<SparseTimeValueModel>
+        (sampleRate, resolution);
+    pitchModel->setScaleUnits(units);
+
+    for (qint64 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+        qint64 frame = 0;
+        float value = 0.f;
+        QString label;
+        stream >> frame >> value >> label;
+        pitchModel->add(Event(frame, value, label));
+    }
+
+    qint32 subtype = 0;
+    stream >> resolution >> units >> subtype >> count;
+
+    auto noteModel = std::make_shared<NoteModel>
+        (sampleRate, resolution, true, NoteModel::Subtype(subtype));
+    noteModel->setScaleUnits(units);
+
+    for (qint64 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+        qint64 frame = 0, duration = 0;
+        float value = 0.f, level = 0.f;
+        bool hasLevel = false;
+        QString label;
+        stream >> frame >> duration >> value >> hasLevel >> level >> label;
+        if (hasLevel) {
+            noteModel->add(Event(frame, value, duration, level, label));
+        } else {
+            noteModel->add(Event(frame, value, duration, label));
+        }
+    }
+
+    if (stream.status() != QDataStream::Ok) {
+        SVDEBUG << "AnalysisCache: entry " << key
+                << " is truncated or corrupt, discarding it" << endl;
+        file.close();
+        file.remove();
+        ++m_misses;
+        return false;
+    }
+
+    file.close();
+
+    // Touch the entry so that eviction sees it as recently used
+    if (file.open(QIODevice::ReadWrite)) {
+        file.setFileTime(QDateTime::currentDateTime(),
+                         QFileDevice::FileModificationTime);
+        file.close();
+    }
+
+    pitchModelId = ModelById::add(pitchModel);
+    noteModelId = ModelById::add(noteModel);
+
+    ++m_hits;
+    SVDEBUG << "AnalysisCache: hit for " << key << " (hits "
+            << m_hits << ", misses " << m_misses << ")" << endl;
+
+    return true;
+}
+
+void
+AnalysisCache::store(QString key, ModelId pitchModelId, ModelId noteModelId)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (key == "") return;
+
+    auto pitchModel = ModelById::getAs<SparseTimeValueModel>(pitchModelId);
+    auto noteModel = ModelById::getAs<NoteModel>(noteModelId);
+    if (!pitchModel || !noteModel) return;
+
+    QString dir = getDirectory();
+    if (dir == "") return;
+
+    QString path = QDir(dir).filePath(key);
+    QString tmpPath = path + ".tmp";
+
+    QFile file(tmpPath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        SVCERR << "AnalysisCache: failed to open " << tmpPath
+               << " for writing" << endl;
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream << cacheMagic << cacheVersion;
+
+    EventVector points = pitchModel->getAllEvents();
+    stream << double(pitchModel->getSampleRate())
+           << qint32(pitchModel->getResolution())
+           << pitchModel->getScaleUnits()
+           << qint64(points.size());
+    for (const auto &p: points) {
+        stream << qint64(p.getFrame()) << p.getValue() << p.getLabel();
+    }
+
+    EventVector notes = noteModel->getAllEvents();
+    stream << qint32(noteModel->getResolution())
+           << noteModel->getScaleUnits()
+           << qint32(noteModel->getSubtype())
+           << qint64(notes.size());
+    for (const auto &n: notes) {
+        stream << qint64(n.getFrame()) << qint64(n.getDuration())
+               << n.getValue() << n.hasLevel() << n.getLevel()
+               << n.getLabel();
+    }
+
+    file.close();
+
+    if (stream.status() != QDataStream::Ok) {
+        SVCERR << "AnalysisCache: failed to write " << tmpPath << endl;
+        QFile::remove(tmpPath);
+        return;
+    }
+
+    QFile::remove(path);
+    if (!QFile::rename(tmpPath, path)) {
+        SVCERR << "AnalysisCache: failed to rename " << tmpPath
+               << " to " << path << endl;
+        QFile::remove(tmpPath);
+        return;
+    }
+
+    SVDEBUG << "AnalysisCache: stored " << points.size() << " pitches and "
+            << notes.size() << " notes as " << key << endl;
+
+    evict(getSizeLimit());
+}
+
+void
+AnalysisCache::evict(qint64 limit)
+{
+    QString dir = getDirectory();
+    if (dir == "") return;
+
+    // Oldest-modified first: retrieve() touches entries it uses
+    QFileInfoList entries = QDir(dir).entryInfoList
+        (QDir::Files, QDir::Time | QDir::Reversed);
+
+    qint64 total = 0;
+    for (const auto &e: entries) {
+        total += e.size();
+    }
+
+    for (const auto &e: entries) {
+        if (total <= limit) break;
+        if (QFile::remove(e.filePath())) {
+            total -= e.size();
+            ++m_evictions;
+            SVDEBUG << "AnalysisCache: evicted " << e.fileName()
+                    << " (evictions " << m_evictions << ")" << endl;
+        }
+    }
+}
@@ -0,0 +1,76 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef ANALYSIS_CACHE_H
+#define ANALYSIS_CACHE_H
+
+#include "data/model/Model.h"
+#include "transform/Transform.h"
+
+#include <QString>
+#include <QMutex>
+
+/**
+ * On-disk cache of initial analysis results (the pitch track and
+ * notes produced by pYIN), keyed by a fingerprint of the audio file
+ * and a hash of the full analysis transform. Entries are evicted
+ * least recently used first once the cache exceeds the size limit
+ * set in the Analyser settings group ("analysis-cache-limit-mb"; 0
+ * disables the cache).
+ */
+class AnalysisCache
+{
+public:
+    static AnalysisCache *getInstance();
+
+    /**
+     * Return the cache key for the analysis of the given audio model
+     * using the given pitch-track transform, or an empty string if
+     * the cache is disabled or the audio is not from a local file.
+     * This reads only a few small blocks of the file, and does not
+     * need the audio to have been decoded.
+     */
+    QString getKey(ModelId audioModel, const Transform &transform);
+
+    /**
+     * Look up the given key. If found, create and register a new
+     * pitch-track model and note model from the cached data, return
+     * their ids in pitchModel and noteModel, and return true.
+     */
+    bool retrieve(QString key, ModelId &pitchModel, ModelId &noteModel);
+
+    /**
+     * Store the contents of the given pitch-track and note models
+     * under the given key, evicting old entries if necessary.
+     */
+    void store(QString key, ModelId pitchModel, ModelId noteModel);
+
+    int getHitCount() const { return m_hits; }
+    int getMissCount() const { return m_misses; }
+    int getEvictionCount() const { return m_evictions; }
+
+protected:
+    AnalysisCache();
+
+    QString getDirectory() const;
+    qint64 getSizeLimit() const;
+    void evict(qint64 limit);
+
+    QMutex m_mutex;
+    int m_hits;
+    int m_misses;
+    int m_evictions;
+};
+
+#endif
@@ -0,0 +1,389 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "BatchAnalyser.h"
+#include "Analyser.h"
+
+#include "data/fileio/AudioFileReaderFactory.h"
+#include "data/fileio/AudioFileReader.h"
+#include "data/fileio/FileSource.h"
+#include "data/fileio/CSVFileWriter.h"
+#include "data/model/SparseTimeValueModel.h"
+#include "data/model/NoteModel.h"
+#include "plugin/FeatureExtractionPluginFactory.h"
+#include "base/Debug.h"
+
+#include <vamp-hostsdk/Plugin.h>
+
+#include <QDir>
+#include <QFileInfo>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QSettings>
+#include <QThread>
+
+#include <cmath>
+
+class BatchTask : public QRunnable
+{
+public:
+    BatchTask(BatchAnalyser *analyser, QString path,
+              Transform transform,
+              std::shared_ptr<std::atomic<bool>> cancelled) :
+        m_analyser(analyser),
+        m_path(path),
+        m_transform(transform),
+        m_cancelled(cancelled) { }
+
+    void run() override {
+        QElapsedTimer timer;
+        timer.start();
+        double duration = 0.0;
+        QString error;
+        try {
+            error = analyse(duration);
+        } catch (const std::exception &e) {
+            error = QString("Exception: %1").arg(e.what());
+        }
+        // A task that stopped because of cancellation has not failed
+        bool cancelled = (error != "" && *m_cancelled);
+        QMetaObject::invokeMethod
+            (m_analyser, "taskDone", Qt::QueuedConnection,
+             Q_ARG(QString, m_path), Q_ARG(QString, error),
+             Q_ARG(bool, cancelled),
+             Q_ARG(double, timer.elapsed() / 1000.0),
+             Q_ARG(double, duration));
+    }
+
+protected:
+    BatchAnalyser *m_analyser;
+    QString m_path;
+    Transform m_transform;
+    std::shared_ptr<std::atomic<bool>> m_cancelled;
+
+    QString analyse(double &duration);
+};
+
+QString
+BatchTask::analyse(double &duration)
+{
+    if (*m_cancelled) return "Cancelled";
+
+    FileSource source(m_path);
+    if (!source.isAvailable()) {
+        return QString("File not found or not readable");
+    }
+    source.waitForData();
+
+    AudioFileReaderFactory::Parameters params;
+    std::unique_ptr<AudioFileReader> reader
+        (AudioFileReaderFactory::createReader(source, params));
+    if (!reader || !reader->isOK()) {
+        return QString("Failed to read audio: %1")
+            .arg(reader ? reader->getError() : QString("unsupported format"));
+    }
+
+    sv_samplerate_t rate = reader->getSampleRate();
+    int channels = reader->getChannelCount();
+    sv_frame_t total = reader->getFrameCount();
+    duration = double(total) / rate;
+
+    int step = m_transform.getStepSize();
+    int block = m_transform.getBlockSize();
+
+    std::shared_ptr<Vamp::Plugin> plugin;
+    {
+        // Plugin loading is not something we want to have going on
+        // in several threads at once
+        static QMutex loadMutex;
+        QMutexLocker locker(&loadMutex);
+        plugin = FeatureExtractionPluginFactory::instance()->instantiatePlugin
+            (m_transform.getPluginIdentifier(), rate);
+    }
+    if (!plugin) {
+        return QString("Failed to load plugin \"%1\"")
+            .arg(m_transform.getPluginIdentifier());
+    }
+    if (plugin->getInputDomain() != Vamp::Plugin::TimeDomain) {
+        return QString("Plugin \"%1\" does not take time-domain input")
+            .arg(m_transform.getPluginIdentifier());
+    }
+
+    for (auto p: m_transform.getParameters()) {
+        plugin->setParameter(p.first.toStdString(), p.second);
+    }
+
+    if (!plugin->initialise(1, step, block)) {
+        return QString("Plugin failed to initialise with step %1 and block %2")
+            .arg(step).arg(block);
+    }
+
+    int pitchOutput = -1, noteOutput = -1;
+    Vamp::Plugin::OutputList outputs = plugin->getOutputDescriptors();
+    for (int i = 0; i < int(outputs.size()); ++i) {
+        if (outputs[i].identifier == "smoothedpitchtrack") pitchOutput = i;
+        if (outputs[i].identifier == "notes") noteOutput = i;
+    }
+    if (pitchOutput < 0 || noteOutput < 0) {
+        return QString("Plugin lacks pitch track or notes output");
+    }
+
+    // Mix down to mono, reading the audio once, a chunk at a time.
+    // Frames behind the current block are only dropped once there is
+    // a whole chunk of them, so that we are not shifting the buffer
+    // down on every step
+
+    const sv_frame_t chunk = 65536;
+    std::vector<float> mono;
+    sv_frame_t monoStart = 0; // frame number of mono[0]
+    sv_frame_t readTo = 0;
+    std::vector<float> buffer(block, 0.f);
+    float *buffers[1] = { buffer.data() };
+
+    Vamp::Plugin::FeatureSet features;
+    int irate = int(round(rate));
+
+    for (sv_frame_t f = 0; f < total; f += step) {
+
+        if (*m_cancelled) return "Cancelled";
+
+        while (readTo < f + block && readTo < total) {
+            sv_frame_t n = std::min(chunk, total - readTo);
+            floatvec_t data = reader->getInterleavedFrames(readTo, n);
+            sv_frame_t got = sv_frame_t(data.size()) / channels;
+            for (sv_frame_t i = 0; i < got; ++i) {
+                float sum = 0.f;
+                for (int c = 0; c < channels; ++c) {
+                    sum += data[i * channels + c];
+                }
+                mono.push_back(sum / float(channels));
+            }
+            if (got < n) {
+                total = readTo + got;
+            }
+            readTo += got;
+            if (got == 0) break;
+        }
+
+        if (f - monoStart >= chunk) {
+            sv_frame_t drop = std::min(f - monoStart, sv_frame_t(mono.size()));
+            mono.erase(mono.begin(), mono.begin() + drop);
+            monoStart += drop;
+        }
+
+        sv_frame_t offset = f - monoStart;
+        sv_frame_t available = sv_frame_t(mono.size()) - offset;
+        for (int i = 0; i < block; ++i) {
+            buffer[i] = (i < available ? mono[offset + i] : 0.f);
+        }
+
+        Vamp::Plugin::FeatureSet fs = plugin->process
+            (buffers, Vamp::RealTime::frame2RealTime(long(f), irate));
+        for (auto &o: fs) {
+            features[o.first].insert(features[o.first].end(),
+                                     o.second.begin(), o.second.end());
+        }
+    }
+
+    Vamp::Plugin::FeatureSet fs = plugin->getRemainingFeatures();
+    for (auto &o: fs) {
+        features[o.first].insert(features[o.first].end(),
+                                 o.second.begin(), o.second.end());
+    }
+
+    auto pitchModel = std::make_shared<SparseTimeValueModel>(rate, step);
+    pitchModel->setScaleUnits("Hz");
+    for (const auto &f: features[pitchOutput]) {
+        if (f.values.empty()) continue;
+        sv_frame_t frame = Vamp::RealTime::realTime2Frame(f.timestamp, irate);
+        pitchModel->add(Event(frame, f.values[0],
+                              QString::fromStdString(f.label)));
+    }
+
+    auto noteModel = std::make_shared<NoteModel>
+        (rate, step, true, NoteModel::FLEXI_NOTE);
+    noteModel->setScaleUnits("Hz");
+    for (const auto &f: features[noteOutput]) {
+        if (f.values.empty()) continue;
+        sv_frame_t frame = Vamp::RealTime::realTime2Frame(f.timestamp, irate);
+        sv_frame_t dur = Vamp::RealTime::realTime2Frame(f.duration, irate);
+        noteModel->add(Event(frame, f.values[0], dur, 1.f,
+                             QString::fromStdString(f.label)));
+    }
+
+    // Extend the models to nominally end with the audio, as
+    // Analyser::extendAnalysisLayers does in the GUI, so that the gap
+    // filling on export runs to the same place as it does there
+
+    pitchModel->extendEndFrame(total);
+    noteModel->extendEndFrame(total);
+
+    QFileInfo fi(m_path);
+    QString base = fi.absoluteDir().filePath(fi.completeBaseName());
+
+    CSVFileWriter pitchWriter(base + ".pitch.csv", pitchModel.get(), ",",
+                              DataExportFillGaps);
+    pitchWriter.write();
+    if (!pitchWriter.isOK()) {
+        return pitchWriter.getError();
+    }
+
+    CSVFileWriter noteWriter(base + ".notes.csv", noteModel.get(), ",",
+                             DataExportOmitLevel);
+    noteWriter.write();
+    if (!noteWriter.isOK()) {
+        return noteWriter.getError();
+    }
+
+    return "";
+}
+
+BatchAnalyser::BatchAnalyser(QObject *parent) :
+    QObject(parent),
+    m_cancelled(new std::atomic<bool>(false)),
+    m_audioTotal(0.0),
+    m_total(0),
+    m_done(0),
+    m_failed(0),
+    m_cancelledCount(0)
+{
+    QSettings settings;
+    settings.beginGroup("Analyser");
+    int threads = settings.value("batch-threads",
+                                 QThread::idealThreadCount()).toInt();
+    settings.endGroup();
+    if (threads < 1) threads = 1;
+    m_pool.setMaxThreadCount(threads);
+}
+
+BatchAnalyser::~BatchAnalyser()
+{
+    cancel();
+    m_pool.waitForDone();
+}
+
+int
+BatchAnalyser::addDirectory(QString directory)
+{
+    QStringList filters;
+    QString extensions = AudioFileReaderFactory::getKnownExtensions();
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 14, 0))
+    QStringList extList = extensions.split(' ', Qt::SkipEmptyParts);
+#else
+    QStringList extList = extensions.split(' ', QString::SkipEmptyParts);
+#endif
+    for (QString ext: extList) {
+        filters << ext;
+    }
+
+    QDir dir(directory);
+    QStringList files = dir.entryList
+        (filters, QDir::Files | QDir::Readable, QDir::Name);
+
+    for (QString file: files) {
+        addFile(dir.filePath(file));
+    }
+
+    return files.size();
+}
+
+void
+BatchAnalyser::addFile(QString path)
+{
+    m_queue.push_back(path);
+}
+
+void
+BatchAnalyser::start()
+{
+    if (!isRunning()) {
+        // Counts are for this run only, not any earlier one
+        *m_cancelled = false;
+        m_timer.start();
+        m_audioTotal = 0.0;
+        m_total = 0;
+        m_done = 0;
+        m_failed = 0;
+        m_cancelledCount = 0;
+    }
+
+    if (m_queue.empty()) {
+        if (!isRunning()) {
+            emit finished(m_done - m_failed - m_cancelledCount,
+                          m_failed, m_cancelledCount);
+        }
+        return;
+    }
+
+    // Same settings as the interactive analysis. The sample rate
+    // here only affects the defaults, which we then override
+    m_transform = Analyser::getAnalysisTransform(44100);
+
+    SVDEBUG << "BatchAnalyser::start: " << m_queue.size()
+            << " file(s) using up to " << m_pool.maxThreadCount()
+            << " thread(s)" << endl;
+
+    for (QString path: m_queue) {
+        m_pool.start(new BatchTask(this, path, m_transform, m_cancelled));
+        ++m_total;
+    }
+    m_queue.clear();
+
+    emit progress(m_done, m_total);
+}
+
+void
+BatchAnalyser::cancel()
+{
+    *m_cancelled = true;
+    m_queue.clear();
+}
+
+void
+BatchAnalyser::taskDone(QString path, QString error, bool cancelled,
+                        double elapsed, double audioDuration)
+{
+    ++m_done;
+    if (cancelled) {
+        ++m_cancelledCount;
+        SVDEBUG << "BatchAnalyser: cancelled analysis of \"" << path
+                << "\"" << endl;
+    } else if (error != "") {
+        ++m_failed;
+        SVCERR << "BatchAnalyser: failed to analyse \"" << path << "\": "
+               << error << endl;
+    } else {
+        m_audioTotal += audioDuration;
+        SVDEBUG << "BatchAnalyser: analysed \"" << path << "\": "
+                << audioDuration << " sec of audio in " << elapsed
+                << " sec (" << (elapsed > 0.0 ? audioDuration / elapsed : 0.0)
+                << "x real time)" << endl;
+    }
+
+    if (!cancelled) {
+        emit fileDone(path, error, elapsed, audioDuration);
+    }
+    emit progress(m_done, m_total);
+
+    if (m_done == m_total) {
+        double elapsedTotal = m_timer.elapsed() / 1000.0;
+        SVDEBUG << "BatchAnalyser: done " << m_done << " file(s), "
+                << m_failed << " failed, " << m_cancelledCount
+                << " cancelled, " << m_audioTotal
+                << " sec of audio in " << elapsedTotal << " sec" << endl;
+        emit finished(m_done - m_failed - m_cancelledCount,
+                      m_failed, m_cancelledCount);
+    }
+}
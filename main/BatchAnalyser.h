@@ -0,0 +1,110 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef BATCH_ANALYSER_H
+#define BATCH_ANALYSER_H
+
+#include "transform/Transform.h"
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <QElapsedTimer>
+
+#include <atomic>
+#include <memory>
+
+/**
+ * Run the same pYIN analysis as Analyser::addAnalyses over a list of
+ * audio files, independently of any open document, using a bounded
+ * pool of worker threads. For each file the pitch track and notes are
+ * written as CSV next to it, in the same form as Export Pitch Track
+ * Data and Export Note Data: foo.wav gives foo.pitch.csv and
+ * foo.notes.csv. A file that fails is reported and skipped.
+ */
+class BatchAnalyser : public QObject
+{
+    Q_OBJECT
+
+public:
+    BatchAnalyser(QObject *parent = 0);
+    virtual ~BatchAnalyser();
+
+    /**
+     * Queue all audio files found directly within the given
+     * directory. Return the number of files queued.
+     */
+    int addDirectory(QString directory);
+
+    void addFile(QString path);
+
+    /**
+     * Start work on the queued files, using the analysis settings
+     * current at the time of the call. Must be called from the GUI
+     * thread.
+     */
+    void start();
+
+    bool isRunning() const { return m_total > m_done; }
+
+    int getTotal() const { return m_total; }
+    int getDone() const { return m_done; }
+    int getFailed() const { return m_failed; }
+    int getCancelled() const { return m_cancelledCount; }
+
+public slots:
+    /**
+     * Abandon any files not yet started, and ask those in progress
+     * to stop.
+     */
+    void cancel();
+
+signals:
+    /**
+     * Emitted when a file has been analysed, or has failed (in which
+     * case error is non-empty). Also reports how long the analysis
+     * took and the duration of the audio, both in seconds. Not
+     * emitted for files abandoned through cancel().
+     */
+    void fileDone(QString path, QString error,
+                  double elapsed, double audioDuration);
+
+    void progress(int done, int total);
+
+    /**
+     * Emitted when all files started by the last call to start()
+     * have been analysed, have failed, or have been cancelled. The
+     * counts cover that run only.
+     */
+    void finished(int succeeded, int failed, int cancelled);
+
+protected slots:
+    void taskDone(QString path, QString error, bool cancelled,
+                  double elapsed, double audioDuration);
+
+protected:
+    QThreadPool m_pool;
+    QStringList m_queue;
+    Transform m_transform;
+    std::shared_ptr<std::atomic<bool>> m_cancelled;
+    QElapsedTimer m_timer;
+    double m_audioTotal;
+    int m_total;
+    int m_done;
+    int m_failed;
+    int m_cancelledCount;
+};
+
+#endif
@@ -18,6 +18,10 @@
 #include "MainWindow.h"
 #include "NetworkPermissionTester.h"
 #include "Analyser.h"
+#include "BatchAnalyser.h"
+#include "NoteBoundaryIndex.h"
+#include "ModelTransaction.h"
+#include "RangeTransformCommand.h"
 
 #include "framework/Document.h"
 #include "framework/VersionTester.h"
@@ -87,6 +91,9 @@
 #include <QWidgetAction>
 #include <QTextEdit>
 #include <QDialogButtonBox>
+#include <QFileDialog>
+#include <QProgressDialog>
+#include <QTimer>
 
 #include <iostream>
 #include <cstdio>
@@ -116,7 +123,13 @@ MainWindow::MainWindow(AudioMode audioMode,
     m_keyReference(new KeyReference()),
     m_selectionAnchor(0),
     m_withSonification(withSonification),
-    m_withSpectrogram(withSpectrogram)
+    m_withSpectrogram(withSpectrogram),
+    m_batchAnalyser(0),
+    m_batchProgress(0),
+    m_undoLimit(50),
+    m_undoMemoryLimit(0),
+    m_undoMemoryChecked(0),
+    m_undoCheckPending(false)
 {
     setWindowTitle(QApplication::applicationName());
 
@@ -297,6 +310,10 @@ MainWindow::MainWindow(AudioMode audioMode,
             m_activityLog, SLOT(activityHappened(QString)));
     connect(CommandHistory::getInstance(), SIGNAL(activity(QString)),
             m_activityLog, SLOT(activityHappened(QString)));
+    connect(CommandHistory::getInstance(), SIGNAL(commandExecuted(Command *)),
+            this, SLOT(historyCommandExecuted(Command *)));
+    connect(CommandHistory::getInstance(), SIGNAL(commandUnexecuted(Command *)),
+            this, SLOT(historyCommandUnexecuted(Command *)));
     connect(this, SIGNAL(activity(QString)),
             m_activityLog, SLOT(activityHappened(QString)));
     connect(this, SIGNAL(replacedDocument()), this, SLOT(documentReplaced()));
@@ -310,9 +327,15 @@ MainWindow::MainWindow(AudioMode audioMode,
 
     settings.beginGroup("MainWindow");
     settings.setValue("zoom-default", 512);
+    m_undoLimit = settings.value("undo-limit", 50).toInt();
+    m_undoMemoryLimit = size_t(settings.value("undo-memory-limit-mb", 64).toInt())
+        * 1024 * 1024;
     settings.endGroup();
     zoomDefault();
 
+    if (m_undoLimit < 1) m_undoLimit = 1;
+    CommandHistory::getInstance()->setUndoLimit(m_undoLimit);
+
     NetworkPermissionTester tester;
     bool networkPermission = tester.havePermission();
     if (networkPermission) {
@@ -448,6 +471,13 @@ MainWindow::setupFileMenu()
     connect(this, SIGNAL(canExportNotes(bool)), action, SLOT(setEnabled(bool)));
     menu->addAction(action);
 
+    menu->addSeparator();
+
+    action = new QAction(tr("Analyse Audio &Folder..."), this);
+    action->setStatusTip(tr("Analyse pitches and notes for every audio file in a folder, writing the results to CSV files alongside them"));
+    connect(action, SIGNAL(triggered()), this, SLOT(analyseFolder()));
+    menu->addAction(action);
+
     menu->addSeparator();
     
     action = new QAction(tr("Browse Recorded Audio"), this);
@@ -1333,62 +1363,54 @@ MainWindow::moveByOneNote(bool right, bool doSelect)
 {
     sv_frame_t frame = m_viewManager->getPlaybackFrame();
     cerr << "MainWindow::moveByOneNote startframe: " << frame << endl;
+
+    Selection sel;
+    if (!getOneNoteStep(right, doSelect, frame, m_selectionAnchor, sel)) {
+        return;
+    }
+    
+    m_viewManager->setPlaybackFrame(frame);
+    if (doSelect) {
+        m_viewManager->setSelection(sel);
+    }
+    cerr << "MainWindow::moveByOneNote endframe: " << frame << endl;
+}
+
+bool
+MainWindow::getOneNoteStep(bool right, bool doSelect, sv_frame_t &frame,
+                           sv_frame_t &anchor, Selection &sel) const
+{
+    frame = m_viewManager->getPlaybackFrame();
+    anchor = m_selectionAnchor;
+    sel = Selection();
     
     bool isAtSelectionBoundary = false;
     MultiSelection::SelectionList selections = m_viewManager->getSelections();
     if (!selections.empty()) {
-        Selection sel = *selections.begin();
-        isAtSelectionBoundary = (frame == sel.getStartFrame()) || (frame == sel.getEndFrame());
+        Selection current = *selections.begin();
+        isAtSelectionBoundary = (frame == current.getStartFrame()) || (frame == current.getEndFrame());
     }
     if (!doSelect || !isAtSelectionBoundary) {
-        m_selectionAnchor = frame;
+        anchor = frame;
     }
 
-    Layer *layer = m_analyser->getLayer(Analyser::Notes);
-    if (!layer) return;
-
-    auto model = ModelById::getAs<NoteModel>(layer->getModel());
-    if (!model) return;
+    const NoteBoundaryIndex *index = m_analyser->getNoteBoundaryIndex();
+    if (!index || index->isEmpty()) return false;
 
-    //!!! This seems like a strange and inefficient way to do this -
-    //!!! there is almost certainly a better way making use of
-    //!!! EventSeries api
-    
-    EventVector points = model->getAllEvents();
-    if (points.empty()) return;
-
-    EventVector::iterator i = points.begin();
-    std::set<sv_frame_t> snapFrames;
-    snapFrames.insert(0);
-    while (i != points.end()) {
-        snapFrames.insert(i->getFrame());
-        snapFrames.insert(i->getFrame() + i->getDuration() + 1);
-        ++i;
-    }
-    std::set<sv_frame_t>::iterator i2;
-    if (snapFrames.find(frame) == snapFrames.end()) {
-        // we're not on an existing snap point, so go to previous
-        snapFrames.insert(frame);
-    }
-    i2 = snapFrames.find(frame);
+    sv_frame_t boundary = frame;
     if (right) {
-        i2++;
-        if (i2 == snapFrames.end()) i2--;
+        if (index->getNextBoundary(frame, boundary)) frame = boundary;
     } else {
-        if (i2 != snapFrames.begin()) i2--;
+        if (index->getPreviousBoundary(frame, boundary)) frame = boundary;
     }
-    frame = *i2;
-    m_viewManager->setPlaybackFrame(frame);
     if (doSelect) {
-        Selection sel;
-        if (frame > m_selectionAnchor) {
-            sel = Selection(m_selectionAnchor, frame);
+        if (frame > anchor) {
+            sel = Selection(anchor, frame);
         } else {
-            sel = Selection(frame, m_selectionAnchor);
+            sel = Selection(frame, anchor);
         }
-        m_viewManager->setSelection(sel);
     }
-    cerr << "MainWindow::moveByOneNote endframe: " << frame << endl;
+    return true;
 }
 
 void
@@ -2239,17 +2261,13 @@ MainWindow::importPitchLayer(FileSource source)
 
                 ModelId modelId = ModelById::add
                     (std::shared_ptr<Model>(model));
-                
-                CommandHistory::getInstance()->startCompoundOperation
-                    (tr("Import Pitch Track"), true);
-
-                Layer *newLayer = m_document->createImportedLayer(modelId);
 
-                m_analyser->takePitchTrackFrom(newLayer);
+                // The imported model is only needed for as long as it
+                // takes to copy its events, so it never gets a layer
+                // or a place in the document
+                m_analyser->takePitchTrackFrom(modelId);
 
-                m_document->deleteLayer(newLayer);
-
-                CommandHistory::getInstance()->endCompoundOperation();
+                ModelById::release(modelId);
 
                 if (!source.isRemote()) {
                     registerLastOpenedFilePath
@@ -2272,6 +2290,8 @@ MainWindow::importPitchLayer(FileSource source)
 void
 MainWindow::exportPitchLayer()
 {
+    m_analyser->commitPitchCandidate();
+
     Layer *layer = m_analyser->getLayer(Analyser::PitchTrack);
     if (!layer) return;
 
@@ -2328,6 +2348,8 @@ MainWindow::exportPitchLayer()
 void
 MainWindow::exportNoteLayer()
 {
+    m_analyser->commitPitchCandidate();
+
     Layer *layer = m_analyser->getLayer(Analyser::Notes);
     if (!layer) return;
 
@@ -2387,6 +2409,115 @@ MainWindow::exportNoteLayer()
     }
 }
 
+void
+MainWindow::analyseFolder()
+{
+    QString dir = QFileDialog::getExistingDirectory
+        (this, tr("Select folder of audio files to analyse"));
+    if (dir == "") return;
+
+    if (!m_batchAnalyser) {
+        m_batchAnalyser = new BatchAnalyser(this);
+        connect(m_batchAnalyser, SIGNAL(fileDone(QString, QString, double, double)),
+                this, SLOT(batchFileDone(QString, QString, double, double)));
+        connect(m_batchAnalyser, SIGNAL(progress(int, int)),
+                this, SLOT(batchProgress(int, int)));
+        connect(m_batchAnalyser, SIGNAL(finished(int, int, int)),
+                this, SLOT(batchFinished(int, int, int)));
+    }
+
+    if (m_batchAnalyser->isRunning()) {
+        // Including one that has been cancelled but has files still
+        // to finish
+        QMessageBox::information
+            (this, tr("Batch analysis in progress"),
+             tr("<b>Batch analysis in progress</b><p>Please wait for the current batch analysis to finish before starting another.</p>"));
+        return;
+    }
+
+    if (m_batchAnalyser->addDirectory(dir) == 0) {
+        QMessageBox::warning
+            (this, tr("No audio files found"),
+             tr("<b>No audio files found</b><p>The folder \"%1\" does not contain any audio files that can be analysed.").arg(dir));
+        return;
+    }
+
+    if (!m_batchProgress) {
+        m_batchProgress = new QProgressDialog
+            (tr("Analysing audio files..."), tr("Cancel"), 0, 0, this);
+        m_batchProgress->setWindowTitle(tr("Batch Analysis"));
+        m_batchProgress->setWindowModality(Qt::NonModal);
+        m_batchProgress->setMinimumDuration(0);
+        m_batchProgress->setAutoClose(false);
+        m_batchProgress->setAutoReset(false);
+        connect(m_batchProgress, SIGNAL(canceled()),
+                m_batchAnalyser, SLOT(cancel()));
+    }
+    m_batchProgress->reset();
+    m_batchProgress->setRange(0, 0);
+    m_batchProgress->setLabelText(tr("Analysing audio files..."));
+    m_batchProgress->show();
+
+    emit activity(tr("Start batch analysis of \"%1\"").arg(dir));
+
+    m_batchAnalyser->start();
+}
+
+void
+MainWindow::batchFileDone(QString path, QString error,
+                          double elapsed, double audioDuration)
+{
+    if (error != "") {
+        emit activity(tr("Batch analysis of \"%1\" failed: %2")
+                      .arg(path).arg(error));
+    } else {
+        emit activity(tr("Batch analysis of \"%1\" done: %2 sec of audio in %3 sec (%4x real time)")
+                      .arg(path)
+                      .arg(audioDuration, 0, 'f', 1)
+                      .arg(elapsed, 0, 'f', 1)
+                      .arg(elapsed > 0.0 ? audioDuration / elapsed : 0.0,
+                           0, 'f', 1));
+    }
+}
+
+void
+MainWindow::batchProgress(int done, int total)
+{
+    if (!m_batchProgress) return;
+    m_batchProgress->setMaximum(total);
+    m_batchProgress->setValue(done);
+    m_batchProgress->setLabelText(tr("Analysed %1 of %2 audio files...")
+                                  .arg(done).arg(total));
+}
+
+void
+MainWindow::batchFinished(int succeeded, int failed, int cancelled)
+{
+    if (m_batchProgress) {
+        m_batchProgress->hide();
+    }
+
+    emit activity(tr("Batch analysis finished: %1 succeeded, %2 failed, %3 cancelled")
+                  .arg(succeeded).arg(failed).arg(cancelled));
+
+    if (cancelled > 0) {
+        // The user knows, having cancelled it
+        return;
+    }
+    
+    if (failed > 0) {
+        QMessageBox::warning
+            (this, tr("Batch analysis finished"),
+             tr("<b>Batch analysis finished</b><p>%1 file(s) were analysed successfully and %2 failed. See the activity log for details.</p>")
+             .arg(succeeded).arg(failed));
+    } else {
+        QMessageBox::information
+            (this, tr("Batch analysis finished"),
+             tr("<b>Batch analysis finished</b><p>%1 file(s) were analysed successfully.</p>")
+             .arg(succeeded));
+    }
+}
+
 void
 MainWindow::browseRecordedAudio()
 {
@@ -2421,18 +2552,27 @@ MainWindow::abandonSelection()
 
     cerr << "MainWindow::abandonSelection()" << endl;
 
-    CommandHistory::getInstance()->startCompoundOperation(tr("Abandon Selection"), true);
+    std::vector<ModelId> models;
+    if (Layer *pitch = m_analyser->getLayer(Analyser::PitchTrack)) {
+        models.push_back(pitch->getModel());
+    }
+    if (Layer *notes = m_analyser->getLayer(Analyser::Notes)) {
+        models.push_back(notes->getModel());
+    }
+
+    ModelTransaction transaction(tr("Abandon Selection"), models);
 
     MultiSelection::SelectionList selections = m_viewManager->getSelections();
     if (!selections.empty()) {
         Selection sel = *selections.begin();
+        transaction.addSelection(sel);
         m_analyser->abandonReAnalysis(sel);
-        auxSnapNotes(sel);
+        auxSnapNotes({ sel });
     }
 
     MainWindowBase::clearSelection();
 
-    CommandHistory::getInstance()->endCompoundOperation();
+    transaction.commit();
 }
 
 void
@@ -2447,11 +2587,29 @@ MainWindow::selectionChangedByUser()
 
     cerr << "MainWindow::selectionChangedByUser" << endl;
 
+    // Keep any pitch candidate chosen for the previous selection
+    m_analyser->commitPitchCandidate();
+
     m_analyser->showPitchCandidates(m_pendingConstraint.isConstrained());
 
     if (!selections.empty()) {
         Selection sel = *selections.begin();
         cerr << "MainWindow::selectionChangedByUser: have selection" << endl;
+
+        // Tell the analyser what the next select-one-note keypress
+        // either way would select, so that it can analyse those in
+        // advance
+        std::vector<Selection> next;
+        for (bool right: { true, false }) {
+            sv_frame_t frame = 0, anchor = 0;
+            Selection s;
+            if (getOneNoteStep(right, true, frame, anchor, s) &&
+                !s.isEmpty() && !(s == sel)) {
+                next.push_back(s);
+            }
+        }
+        m_analyser->setNextSelections(next);
+        
         QString error = m_analyser->reAnalyseSelection
             (sel, m_pendingConstraint);
         if (error != "") {
@@ -2505,6 +2663,8 @@ MainWindow::regionOutlined(QRect r)
 void
 MainWindow::clearPitches()
 {
+    m_analyser->commitPitchCandidate();
+
     MultiSelection::SelectionList selections = m_viewManager->getSelections();
 
     CommandHistory::getInstance()->startCompoundOperation(tr("Clear Pitches"), true);
@@ -2512,8 +2672,8 @@ MainWindow::clearPitches()
     for (MultiSelection::SelectionList::iterator k = selections.begin();
          k != selections.end(); ++k) {
         m_analyser->deletePitches(*k);
-        auxSnapNotes(*k);
     }
+    auxSnapNotes(selections);
 
     CommandHistory::getInstance()->endCompoundOperation();
 }
@@ -2521,6 +2681,8 @@ MainWindow::clearPitches()
 void
 MainWindow::octaveShift(bool up)
 {
+    m_analyser->commitPitchCandidate();
+
     MultiSelection::SelectionList selections = m_viewManager->getSelections();
 
     CommandHistory::getInstance()->startCompoundOperation
@@ -2528,10 +2690,9 @@ MainWindow::octaveShift(bool up)
 
     for (MultiSelection::SelectionList::iterator k = selections.begin();
          k != selections.end(); ++k) {
-
         m_analyser->shiftOctave(*k, up);
-        auxSnapNotes(*k);
     }
+    auxSnapNotes(selections);
 
     CommandHistory::getInstance()->endCompoundOperation();
 }
@@ -2539,6 +2700,8 @@ MainWindow::octaveShift(bool up)
 void
 MainWindow::togglePitchCandidates()
 {
+    m_analyser->commitPitchCandidate();
+
     CommandHistory::getInstance()->startCompoundOperation(tr("Toggle Pitch Candidates"), true);
 
     m_analyser->showPitchCandidates(!m_analyser->arePitchCandidatesShown());
@@ -2553,19 +2716,7 @@ MainWindow::switchPitchUp()
 {
     if (m_analyser->arePitchCandidatesShown()) {
         if (m_analyser->haveHigherPitchCandidate()) {
-
-            CommandHistory::getInstance()->startCompoundOperation
-                (tr("Choose Higher Pitch Candidate"), true);
-
-            MultiSelection::SelectionList selections = m_viewManager->getSelections();
-
-            for (MultiSelection::SelectionList::iterator k = selections.begin();
-                 k != selections.end(); ++k) {
-                m_analyser->switchPitchCandidate(*k, true);
-                auxSnapNotes(*k);
-            }
-
-            CommandHistory::getInstance()->endCompoundOperation();
+            chooseCandidate(true);
         }
     } else {
         octaveShift(true);
@@ -2577,28 +2728,116 @@ MainWindow::switchPitchDown()
 {
     if (m_analyser->arePitchCandidatesShown()) {
         if (m_analyser->haveLowerPitchCandidate()) {
+            chooseCandidate(false);
+        }
+    } else {
+        octaveShift(false);
+    }
+}
+
+void
+MainWindow::chooseCandidate(bool up)
+{
+    // This only moves the highlight between the candidates. The
+    // choice is written to the pitch track, as one undoable command,
+    // when the user moves on (see Analyser::commitPitchCandidate)
+    
+    m_analyser->choosePitchCandidate(m_viewManager->getSelections(), up);
+    updateMenuStates();
+}
 
-            CommandHistory::getInstance()->startCompoundOperation
-                (tr("Choose Lower Pitch Candidate"), true);
+void
+MainWindow::historyCommandExecuted(Command *)
+{
+    // Not from within the CommandHistory's own signal, which may be
+    // emitted in the middle of it adding a command
+    if (!m_undoCheckPending) {
+        m_undoCheckPending = true;
+        QTimer::singleShot(0, this, SLOT(limitUndoMemory()));
+    }
+}
 
-            MultiSelection::SelectionList selections = m_viewManager->getSelections();
-            
-            for (MultiSelection::SelectionList::iterator k = selections.begin();
-                 k != selections.end(); ++k) {
-                m_analyser->switchPitchCandidate(*k, false);
-                auxSnapNotes(*k);
+void
+MainWindow::historyCommandUnexecuted(Command *)
+{
+    // An uncommitted candidate choice was made against the state we
+    // have just undone
+    m_analyser->discardPitchCandidateChoice();
+
+    if (!m_undoCheckPending) {
+        m_undoCheckPending = true;
+        QTimer::singleShot(0, this, SLOT(limitUndoMemory()));
+    }
+}
+
+void
+MainWindow::limitUndoMemory()
+{
+    // The budget covers pitch-track edits (RangeTransformCommand)
+    // only. Note edits, Snap Notes and the other commands from svgui
+    // don't tell us how much they hold, so they are limited only by
+    // the number of undo steps.
+    //
+    // CommandHistory only knows how to limit the number of undo
+    // steps, and doesn't tell us how many it holds. So when over
+    // budget we lower the limit one step at a time from the normal
+    // one: a limit at or above the current depth changes nothing,
+    // and each one below it drops the oldest step. The most recent
+    // step is always kept. We only expect to free what was already
+    // on the undo stack at the last check (anything since then is in
+    // the newest steps), and we stop as soon as a lower limit frees
+    // nothing after others have, as what remains is not in the
+    // oldest steps
+
+    m_undoCheckPending = false;
+    
+    size_t before = RangeTransformCommand::getExecutedByteCount();
+    size_t freeable = std::min(m_undoMemoryChecked, before);
+
+    if (m_undoMemoryLimit > 0 && before > m_undoMemoryLimit &&
+        freeable > 0) {
+
+        CommandHistory *history = CommandHistory::getInstance();
+        size_t freed = 0;
+
+        for (int limit = m_undoLimit - 1; limit > 0; --limit) {
+            size_t prior = RangeTransformCommand::getExecutedByteCount();
+            history->setUndoLimit(limit);
+            size_t now = RangeTransformCommand::getExecutedByteCount();
+            if (now < prior) {
+                freed += prior - now;
+            } else if (freed > 0) {
+                break;
             }
+            if (now <= m_undoMemoryLimit || freed >= freeable) {
+                break;
+            }
+        }
 
-            CommandHistory::getInstance()->endCompoundOperation();
+        history->setUndoLimit(m_undoLimit);
+
+        if (freed > 0) {
+            emit activity(tr("Discarded oldest undo steps to stay within pitch-track undo memory limit, freeing %1 KB")
+                          .arg(freed / 1024));
         }
-    } else {
-        octaveShift(false);
+    }
+
+    m_undoMemoryChecked = RangeTransformCommand::getExecutedByteCount();
+
+    QString status = tr("Undo history holds %1 KB of pitch-track edits (note edits and Snap Notes are not counted)")
+        .arg(m_undoMemoryChecked / 1024);
+
+    if (status != m_undoStatus) {
+        m_undoStatus = status;
+        emit activity(status);
     }
 }
 
 void
 MainWindow::snapNotesToPitches()
 {
+    m_analyser->commitPitchCandidate();
+
     cerr << "in snapNotesToPitches" << endl;
     MultiSelection::SelectionList selections = m_viewManager->getSelections();
 
@@ -2606,30 +2845,25 @@ MainWindow::snapNotesToPitches()
 
         CommandHistory::getInstance()->startCompoundOperation
             (tr("Snap Notes to Pitches"), true);
-                
-        for (MultiSelection::SelectionList::iterator k = selections.begin();
-             k != selections.end(); ++k) {
-            auxSnapNotes(*k);
-        }
+
+        auxSnapNotes(selections);
         
         CommandHistory::getInstance()->endCompoundOperation();
     }
 }
 
 void
-MainWindow::auxSnapNotes(Selection s)
+MainWindow::auxSnapNotes(const MultiSelection::SelectionList &selections)
 {
     cerr << "in auxSnapNotes" << endl;
-    FlexiNoteLayer *layer =
-        qobject_cast<FlexiNoteLayer *>(m_analyser->getLayer(Analyser::Notes));
-    if (!layer) return;
-
-    layer->snapSelectedNotesToPitchTrack(m_analyser->getPane(), s);
+    m_analyser->snapNotesToPitchTrack(selections);
 }    
 
 void
 MainWindow::splitNote()
 {
+    m_analyser->commitPitchCandidate();
+
     FlexiNoteLayer *layer =
         qobject_cast<FlexiNoteLayer *>(m_analyser->getLayer(Analyser::Notes));
     if (!layer) return;
@@ -2640,6 +2874,8 @@ MainWindow::splitNote()
 void
 MainWindow::mergeNotes()
 {
+    m_analyser->commitPitchCandidate();
+
     FlexiNoteLayer *layer =
         qobject_cast<FlexiNoteLayer *>(m_analyser->getLayer(Analyser::Notes));
     if (!layer) return;
@@ -2648,21 +2884,28 @@ MainWindow::mergeNotes()
 
     if (!selections.empty()) {
 
-        CommandHistory::getInstance()->startCompoundOperation
-            (tr("Merge Notes"), true);
+        ModelTransaction transaction(tr("Merge Notes"),
+                                     { layer->getModel() });
+
+        for (MultiSelection::SelectionList::iterator k = selections.begin();
+             k != selections.end(); ++k) {
+            transaction.addSelection(*k);
+        }
                 
         for (MultiSelection::SelectionList::iterator k = selections.begin();
              k != selections.end(); ++k) {
             layer->mergeNotes(m_analyser->getPane(), *k, true);
         }
         
-        CommandHistory::getInstance()->endCompoundOperation();
+        transaction.commit();
     }
 }
 
 void
 MainWindow::deleteNotes()
 {
+    m_analyser->commitPitchCandidate();
+
     FlexiNoteLayer *layer =
         qobject_cast<FlexiNoteLayer *>(m_analyser->getLayer(Analyser::Notes));
     if (!layer) return;
@@ -2671,15 +2914,20 @@ MainWindow::deleteNotes()
 
     if (!selections.empty()) {
 
-        CommandHistory::getInstance()->startCompoundOperation
-            (tr("Delete Notes"), true);
+        ModelTransaction transaction(tr("Delete Notes"),
+                                     { layer->getModel() });
+
+        for (MultiSelection::SelectionList::iterator k = selections.begin();
+             k != selections.end(); ++k) {
+            transaction.addSelection(*k);
+        }
                 
         for (MultiSelection::SelectionList::iterator k = selections.begin();
              k != selections.end(); ++k) {
             layer->deleteSelectionInclusive(*k);
         }
         
-        CommandHistory::getInstance()->endCompoundOperation();
+        transaction.commit();
     }
 }
 
@@ -2687,6 +2935,8 @@ MainWindow::deleteNotes()
 void
 MainWindow::formNoteFromSelection()
 {
+    m_analyser->commitPitchCandidate();
+
     Pane *pane = m_analyser->getPane();
     Layer *layer0 = m_analyser->getLayer(Analyser::Notes);
     auto model = ModelById::getAs<NoteModel>(layer0->getModel());
@@ -2696,9 +2946,14 @@ MainWindow::formNoteFromSelection()
     MultiSelection::SelectionList selections = m_viewManager->getSelections();
 
     if (!selections.empty()) {
-    
-        CommandHistory::getInstance()->startCompoundOperation
-            (tr("Form Note from Selection"), true);
+
+        ModelTransaction transaction(tr("Form Note from Selection"),
+                                     { layer->getModel() });
+
+        for (MultiSelection::SelectionList::iterator k = selections.begin();
+             k != selections.end(); ++k) {
+            transaction.addSelection(*k);
+        }
 
         for (MultiSelection::SelectionList::iterator k = selections.begin();
              k != selections.end(); ++k) {
@@ -2732,7 +2987,7 @@ MainWindow::formNoteFromSelection()
             layer->mergeNotes(pane, *k, false);
         }
 
-        CommandHistory::getInstance()->endCompoundOperation();     
+        transaction.commit();
     }
 }
 
@@ -22,6 +22,9 @@
 class VersionTester;
 class ActivityLog;
 class LevelPanToolButton;
+class BatchAnalyser;
+class QProgressDialog;
+class Command;
 
 class MainWindow : public MainWindowBase
 {
@@ -54,6 +57,7 @@ protected slots:
     virtual void exportPitchLayer();
     virtual void exportNoteLayer();
     virtual void importPitchLayer();
+    virtual void analyseFolder();
     virtual void browseRecordedAudio();
     virtual void newSession();
     virtual void closeSession();
@@ -170,6 +174,14 @@ protected slots:
 
     virtual void analyseNewMainModel();
 
+    virtual void batchFileDone(QString, QString, double, double);
+    virtual void batchProgress(int, int);
+    virtual void batchFinished(int, int, int);
+
+    virtual void historyCommandExecuted(Command *);
+    virtual void historyCommandUnexecuted(Command *);
+    virtual void limitUndoMemory();
+
     void moveOneNoteRight();
     void moveOneNoteLeft();
     void selectOneNoteRight();
@@ -231,6 +243,20 @@ protected:
 
     Analyser::FrequencyRange m_pendingConstraint;
 
+    BatchAnalyser   *m_batchAnalyser;
+    QProgressDialog *m_batchProgress;
+
+    // Limits on the CommandHistory's undo steps, and on the memory
+    // used by pitch-track edits in them (the only commands whose size
+    // we can measure: see limitUndoMemory). Also the pitch-track undo
+    // memory at the last check, the last report sent to the activity
+    // log, and whether a check is already scheduled
+    int m_undoLimit;
+    size_t m_undoMemoryLimit;
+    size_t m_undoMemoryChecked;
+    QString m_undoStatus;
+    bool m_undoCheckPending;
+
     QString exportToSVL(QString path, Layer *layer);
     FileOpenStatus importPitchLayer(FileSource source);
 
@@ -245,8 +271,9 @@ protected:
     virtual void setupToolbars();
 
     virtual void octaveShift(bool up);
+    virtual void chooseCandidate(bool up);
 
-    virtual void auxSnapNotes(Selection s);
+    virtual void auxSnapNotes(const MultiSelection::SelectionList &);
 
     virtual void closeEvent(QCloseEvent *e);
     bool checkSaveModified();
@@ -256,6 +283,13 @@ protected:
     virtual void updatePositionStatusDisplays() const;
 
     void moveByOneNote(bool right, bool doSelect);
+
+    // Find where moveByOneNote would move the playback position to,
+    // the selection anchor it would use, and (if doSelect) the
+    // selection it would make, without doing any of it. Return false
+    // if there are no notes to move by
+    bool getOneNoteStep(bool right, bool doSelect, sv_frame_t &frame,
+                        sv_frame_t &anchor, Selection &sel) const;
 };
 
 
@@ -0,0 +1,199 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ModelTransaction.h"
+
+#include "data/model/NoteModel.h"
+#include "data/model/SparseTimeValueModel.h"
+#include "widgets/CommandHistory.h"
+#include "base/Debug.h"
+
+#include <algorithm>
+
+std::vector<ModelTransaction *> ModelTransaction::m_open;
+
+ModelTransaction::ModelTransaction(QString name, std::vector<ModelId> models) :
+    m_models(models),
+    m_compound(true),
+    m_committed(false)
+{
+    CommandHistory::getInstance()->startCompoundOperation(name, true);
+    open();
+}
+
+ModelTransaction::ModelTransaction(std::vector<ModelId> models) :
+    m_models(models),
+    m_compound(false),
+    m_committed(false)
+{
+    open();
+}
+
+void
+ModelTransaction::open()
+{
+    for (ModelId id: m_models) {
+        auto model = ModelById::get(id);
+        m_wasBlocked.push_back(model ? model->blockSignals(true) : false);
+        m_extents.push_back(getExtents(id));
+    }
+    m_open.push_back(this);
+}
+
+ModelTransaction *
+ModelTransaction::getEnclosing(ModelId id)
+{
+    for (auto i = m_open.rbegin(); i != m_open.rend(); ++i) {
+        const auto &models = (*i)->m_models;
+        if (std::find(models.begin(), models.end(), id) != models.end()) {
+            return *i;
+        }
+    }
+    return 0;
+}
+
+ModelTransaction::Extents
+ModelTransaction::getExtents(ModelId id)
+{
+    Extents extents;
+    if (auto notes = ModelById::getAs<NoteModel>(id)) {
+        extents.empty = notes->isEmpty();
+        extents.min = notes->getValueMinimum();
+        extents.max = notes->getValueMaximum();
+    } else if (auto pitches = ModelById::getAs<SparseTimeValueModel>(id)) {
+        extents.empty = pitches->isEmpty();
+        extents.min = pitches->getValueMinimum();
+        extents.max = pitches->getValueMaximum();
+    }
+    return extents;
+}
+
+ModelTransaction::~ModelTransaction()
+{
+    if (!m_committed) {
+        commit();
+    }
+}
+
+void
+ModelTransaction::addRange(sv_frame_t start, sv_frame_t end)
+{
+    if (end < start) std::swap(start, end);
+    m_ranges.push_back({ start, end });
+}
+
+void
+ModelTransaction::addSelection(const Selection &selection)
+{
+    sv_frame_t start = selection.getStartFrame();
+    sv_frame_t end = selection.getEndFrame();
+
+    for (ModelId id: m_models) {
+        auto notes = ModelById::getAs<NoteModel>(id);
+        if (!notes) continue;
+        EventVector spanning = notes->getEventsSpanning(start, end - start);
+        for (const auto &n: spanning) {
+            start = std::min(start, n.getFrame());
+            end = std::max(end, n.getFrame() + n.getDuration());
+        }
+    }
+
+    // Models report changes to a note as reaching one resolution
+    // step beyond its end, so we do the same
+    int resolution = 0;
+    for (ModelId id: m_models) {
+        if (auto model = ModelById::get(id)) {
+            resolution = std::max(resolution, model->getResolution());
+        }
+    }
+    end += resolution;
+
+    addRange(start, end);
+}
+
+void
+ModelTransaction::commit()
+{
+    if (m_committed) return;
+    m_committed = true;
+
+    m_open.erase(std::remove(m_open.begin(), m_open.end(), this),
+                 m_open.end());
+
+    for (int i = 0; i < int(m_models.size()); ++i) {
+        if (auto model = ModelById::get(m_models[i])) {
+            model->blockSignals(m_wasBlocked[i]);
+        }
+    }
+
+    if (m_compound) {
+        CommandHistory::getInstance()->endCompoundOperation();
+    }
+
+    // Merge overlapping or adjacent ranges, leaving the gaps
+    // between them alone
+    
+    std::sort(m_ranges.begin(), m_ranges.end(),
+              [](const Range &a, const Range &b) {
+                  return a.start < b.start;
+              });
+
+    std::vector<Range> merged;
+    for (const Range &r: m_ranges) {
+        if (!merged.empty() && r.start <= merged.rbegin()->end) {
+            merged.rbegin()->end = std::max(merged.rbegin()->end, r.end);
+        } else {
+            merged.push_back(r);
+        }
+    }
+
+    std::vector<ModelTransaction *> informed;
+    
+    for (int i = 0; i < int(m_models.size()); ++i) {
+
+        // If an enclosing transaction is holding this model's
+        // signals, it will report the change, but it may not know
+        // about our ranges
+        if (m_wasBlocked[i]) {
+            ModelTransaction *enclosing = getEnclosing(m_models[i]);
+            if (enclosing &&
+                std::find(informed.begin(), informed.end(), enclosing) ==
+                informed.end()) {
+                enclosing->m_ranges.insert(enclosing->m_ranges.end(),
+                                           merged.begin(), merged.end());
+                informed.push_back(enclosing);
+            }
+            continue;
+        }
+        
+        auto model = ModelById::get(m_models[i]);
+        if (!model) continue;
+
+        // The model emits a plain modelChanged when its value extents
+        // change (so that auto-aligned scales follow), which we held
+        // back along with everything else
+        if (!(getExtents(m_models[i]) == m_extents[i])) {
+            SVDEBUG << "ModelTransaction::commit: value extents changed, "
+                    << "reporting change to whole model" << endl;
+            emit model->modelChanged(m_models[i]);
+            continue;
+        }
+
+        for (const Range &r: merged) {
+            SVDEBUG << "ModelTransaction::commit: reporting change from "
+                    << r.start << " to " << r.end << endl;
+            emit model->modelChangedWithin(m_models[i], r.start, r.end);
+        }
+    }
+}
@@ -0,0 +1,115 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef MODEL_TRANSACTION_H
+#define MODEL_TRANSACTION_H
+
+#include "data/model/Model.h"
+#include "base/Selection.h"
+
+#include <QString>
+
+#include <vector>
+
+/**
+ * Scope for a batch of edits to one or more models (typically the
+ * notes and pitch track) that should appear to the rest of the
+ * application as a single change. While the transaction is open, the
+ * models' change notifications are held back and all commands are
+ * gathered into a single compound command. On commit, the compound
+ * command is closed and each model reports a change over the frame
+ * ranges given to the transaction.
+ *
+ * The models cannot tell us what they changed while their signals
+ * are blocked, so the caller must describe the affected ranges with
+ * addRange() or addSelection() before making its edits.
+ *
+ * Each disjoint range is reported separately, so that views and
+ * indexes only need to revisit the parts that actually changed. If
+ * the edits changed a model's value extents, the model is reported
+ * as changed throughout instead, as it would have reported itself.
+ *
+ * The transaction commits when it goes out of scope, if commit() has
+ * not already been called.
+ */
+class ModelTransaction
+{
+public:
+    /**
+     * Open a transaction that gathers commands into a compound
+     * command with the given name, as well as holding back change
+     * notifications.
+     */
+    ModelTransaction(QString name, std::vector<ModelId> models);
+
+    /**
+     * Open a transaction that only holds back change notifications,
+     * for use within a command's own execute() and unexecute().
+     * Transactions may be nested: an inner one passes its ranges to
+     * the one enclosing it, leaving the reporting to the outermost.
+     */
+    ModelTransaction(std::vector<ModelId> models);
+    
+    ~ModelTransaction();
+
+    /**
+     * Note that the given frame range may be changed.
+     */
+    void addRange(sv_frame_t start, sv_frame_t end);
+
+    /**
+     * Note that the given selection may be changed, together with
+     * the whole of any note that overlaps it (for edits that split,
+     * merge, or delete notes).
+     */
+    void addSelection(const Selection &selection);
+
+    void commit();
+
+protected:
+    struct Range {
+        sv_frame_t start;
+        sv_frame_t end;
+    };
+
+    struct Extents {
+        Extents() : empty(true), min(0.f), max(0.f) { }
+        bool empty;
+        float min;
+        float max;
+        bool operator==(const Extents &e) const {
+            return empty == e.empty && min == e.min && max == e.max;
+        }
+    };
+
+    std::vector<ModelId> m_models;
+    std::vector<bool> m_wasBlocked;
+    std::vector<Extents> m_extents;
+    std::vector<Range> m_ranges;
+    bool m_compound;
+    bool m_committed;
+
+    void open();
+    static Extents getExtents(ModelId);
+
+    // Transactions not yet committed, outermost first (all on the
+    // GUI thread)
+    static std::vector<ModelTransaction *> m_open;
+    static ModelTransaction *getEnclosing(ModelId);
+
+    ModelTransaction(const ModelTransaction &) = delete;
+    ModelTransaction &operator=(const ModelTransaction &) = delete;
+};
+
+#endif
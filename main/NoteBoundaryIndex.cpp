@@ -0,0 +1,166 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "NoteBoundaryIndex.h"
+
+#include "data/model/NoteModel.h"
+#include "base/Debug.h"
+
+NoteBoundaryIndex::NoteBoundaryIndex(QObject *parent) :
+    QObject(parent)
+{
+}
+
+NoteBoundaryIndex::~NoteBoundaryIndex()
+{
+}
+
+void
+NoteBoundaryIndex::setModel(ModelId modelId)
+{
+    if (auto previous = ModelById::get(m_model)) {
+        disconnect(previous.get(), 0, this, 0);
+    }
+
+    m_model = modelId;
+
+    if (auto model = ModelById::get(m_model)) {
+        connect(model.get(), SIGNAL(modelChanged(ModelId)),
+                this, SLOT(modelChanged(ModelId)));
+        connect(model.get(),
+                SIGNAL(modelChangedWithin(ModelId, sv_frame_t, sv_frame_t)),
+                this,
+                SLOT(modelChangedWithin(ModelId, sv_frame_t, sv_frame_t)));
+    }
+
+    rebuild();
+}
+
+void
+NoteBoundaryIndex::rebuild()
+{
+    m_notes.clear();
+    m_boundaries.clear();
+
+    auto model = ModelById::getAs<NoteModel>(m_model);
+    if (!model) return;
+
+    EventVector notes = model->getAllEvents();
+    for (const auto &n: notes) {
+        add(n.getFrame(), n.getFrame() + n.getDuration());
+    }
+
+    SVDEBUG << "NoteBoundaryIndex::rebuild: " << m_notes.size()
+            << " notes" << endl;
+}
+
+void
+NoteBoundaryIndex::add(sv_frame_t start, sv_frame_t end)
+{
+    m_notes.insert({ start, end });
+    m_boundaries.insert(start);
+    m_boundaries.insert(end + 1);
+}
+
+void
+NoteBoundaryIndex::removeBoundary(sv_frame_t frame)
+{
+    // Remove one instance only, as other notes may share it
+    auto i = m_boundaries.find(frame);
+    if (i != m_boundaries.end()) {
+        m_boundaries.erase(i);
+    }
+}
+
+void
+NoteBoundaryIndex::modelChanged(ModelId)
+{
+    rebuild();
+}
+
+void
+NoteBoundaryIndex::modelChangedWithin(ModelId, sv_frame_t f0, sv_frame_t f1)
+{
+    auto model = ModelById::getAs<NoteModel>(m_model);
+    if (!model) return;
+
+    // Any note that was added, removed or changed starts within the
+    // range that the model reports, so we drop everything we have
+    // starting there and re-read it
+
+    auto i0 = m_notes.lower_bound(f0);
+    auto i1 = m_notes.lower_bound(f1);
+    for (auto i = i0; i != i1; ++i) {
+        removeBoundary(i->first);
+        removeBoundary(i->second + 1);
+    }
+    m_notes.erase(i0, i1);
+
+    EventVector notes = model->getEventsSpanning(f0, f1 - f0);
+    for (const auto &n: notes) {
+        if (n.getFrame() >= f0 && n.getFrame() < f1) {
+            add(n.getFrame(), n.getFrame() + n.getDuration());
+        }
+    }
+}
+
+bool
+NoteBoundaryIndex::getNextBoundary(sv_frame_t frame, sv_frame_t &boundary) const
+{
+    if (frame < 0) {
+        boundary = 0;
+        return true;
+    }
+    auto i = m_boundaries.upper_bound(frame);
+    if (i == m_boundaries.end()) return false;
+    boundary = *i;
+    return true;
+}
+
+bool
+NoteBoundaryIndex::getPreviousBoundary(sv_frame_t frame, sv_frame_t &boundary) const
+{
+    if (frame <= 0) return false;
+    auto i = m_boundaries.lower_bound(frame);
+    if (i == m_boundaries.begin()) {
+        boundary = 0;
+        return true;
+    }
+    --i;
+    boundary = std::max(*i, sv_frame_t(0));
+    return true;
+}
+
+bool
+NoteBoundaryIndex::getNoteBefore(sv_frame_t frame,
+                                 sv_frame_t &start, sv_frame_t &end) const
+{
+    auto i = m_notes.lower_bound(frame);
+    if (i == m_notes.begin()) return false;
+    --i;
+    start = i->first;
+    end = i->second;
+    return true;
+}
+
+bool
+NoteBoundaryIndex::getNoteAtOrAfter(sv_frame_t frame,
+                                    sv_frame_t &start, sv_frame_t &end) const
+{
+    auto i = m_notes.lower_bound(frame);
+    if (i == m_notes.end()) return false;
+    start = i->first;
+    end = i->second;
+    return true;
+}
@@ -0,0 +1,94 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef NOTE_BOUNDARY_INDEX_H
+#define NOTE_BOUNDARY_INDEX_H
+
+#include "data/model/Model.h"
+
+#include <QObject>
+
+#include <map>
+#include <set>
+
+/**
+ * Sorted index of the note starts and ends in a NoteModel, for
+ * stepping from note to note without retrieving every note each
+ * time. The index is kept up to date from the model's change
+ * notifications, re-reading only the notes that start within each
+ * changed range.
+ */
+class NoteBoundaryIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    NoteBoundaryIndex(QObject *parent = 0);
+    virtual ~NoteBoundaryIndex();
+
+    /**
+     * Index the given note model, replacing any previous one. Pass
+     * an empty id to clear the index.
+     */
+    void setModel(ModelId model);
+    ModelId getModel() const { return m_model; }
+
+    bool isEmpty() const { return m_notes.empty(); }
+
+    /**
+     * Find the first navigation boundary after the given frame. The
+     * boundaries are frame 0, each note start, and the frame after
+     * each note end. Return false if there is none.
+     */
+    bool getNextBoundary(sv_frame_t frame, sv_frame_t &boundary) const;
+
+    /**
+     * Find the last navigation boundary before the given frame.
+     * Return false if there is none.
+     */
+    bool getPreviousBoundary(sv_frame_t frame, sv_frame_t &boundary) const;
+
+    /**
+     * Find the start and end of the note that starts most recently
+     * before the given frame. Return false if there is none.
+     */
+    bool getNoteBefore(sv_frame_t frame,
+                       sv_frame_t &start, sv_frame_t &end) const;
+
+    /**
+     * Find the start and end of the first note that starts at or
+     * after the given frame. Return false if there is none.
+     */
+    bool getNoteAtOrAfter(sv_frame_t frame,
+                          sv_frame_t &start, sv_frame_t &end) const;
+
+protected slots:
+    void modelChanged(ModelId);
+    void modelChangedWithin(ModelId, sv_frame_t, sv_frame_t);
+
+protected:
+    ModelId m_model;
+
+    // note start -> note end (start + duration)
+    std::multimap<sv_frame_t, sv_frame_t> m_notes;
+
+    // note starts and note ends + 1
+    std::multiset<sv_frame_t> m_boundaries;
+
+    void rebuild();
+    void add(sv_frame_t start, sv_frame_t end);
+    void removeBoundary(sv_frame_t frame);
+};
+
+#endif
@@ -0,0 +1,445 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "PitchTrackIndex.h"
+
+#include "data/model/SparseTimeValueModel.h"
+#include "base/Debug.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// Number of pitch-track points (at the model's resolution) covered by
+// each bucket
+static const int pointsPerBucket = 64;
+
+// Number of children of each tree node, and number of levels of
+// nodes above the buckets
+static const int fanout = 8;
+static const int maxLevels = 4;
+
+// A change reported over more buckets than this rebuilds the lot
+static const sv_frame_t maxBucketsPerChange = 1024;
+
+// A median over no more values than this is found by selection over
+// a copy of them, which is quicker than bisecting at that size
+static const int maxValuesToCopy = 512;
+
+// Map a float to an unsigned integer key that sorts in the same
+// order, and back again, so that we can bisect over values
+static uint32_t
+keyFor(float v)
+{
+    uint32_t u;
+    memcpy(&u, &v, sizeof(u));
+    return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+static float
+valueFor(uint32_t k)
+{
+    uint32_t u = (k & 0x80000000u) ? (k & 0x7fffffffu) : ~k;
+    float v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+PitchTrackIndex::PitchTrackIndex(QObject *parent) :
+    QObject(parent),
+    m_bucketWidth(pointsPerBucket)
+{
+}
+
+PitchTrackIndex::~PitchTrackIndex()
+{
+}
+
+void
+PitchTrackIndex::setModel(ModelId modelId)
+{
+    if (auto previous = ModelById::get(m_model)) {
+        disconnect(previous.get(), 0, this, 0);
+    }
+
+    m_model = modelId;
+
+    if (auto model = ModelById::get(m_model)) {
+        connect(model.get(), SIGNAL(modelChanged(ModelId)),
+                this, SLOT(modelChanged(ModelId)));
+        connect(model.get(),
+                SIGNAL(modelChangedWithin(ModelId, sv_frame_t, sv_frame_t)),
+                this,
+                SLOT(modelChangedWithin(ModelId, sv_frame_t, sv_frame_t)));
+    }
+
+    rebuild();
+}
+
+sv_frame_t
+PitchTrackIndex::span(int level)
+{
+    sv_frame_t s = fanout;
+    for (int l = 0; l < level; ++l) s *= fanout;
+    return s;
+}
+
+void
+PitchTrackIndex::rebuild()
+{
+    m_buckets.clear();
+    m_levels.clear();
+
+    auto model = ModelById::getAs<SparseTimeValueModel>(m_model);
+    if (!model) return;
+
+    m_bucketWidth = sv_frame_t(std::max(model->getResolution(), 1)) *
+        pointsPerBucket;
+
+    EventVector points = model->getAllEvents();
+    for (const auto &p: points) {
+        sv_frame_t frame = p.getFrame();
+        if (frame < 0) continue;
+        size_t b = size_t(frame / m_bucketWidth);
+        if (b >= m_buckets.size()) m_buckets.resize(b + 1);
+        m_buckets[b].points.push_back({ frame, p.getValue() });
+    }
+
+    for (auto &b: m_buckets) {
+        summariseBucket(b);
+    }
+
+    resizeLevels();
+
+    SVDEBUG << "PitchTrackIndex::rebuild: " << points.size()
+            << " points in " << m_buckets.size() << " buckets" << endl;
+}
+
+void
+PitchTrackIndex::rebuildBucket(sv_frame_t bucketNo)
+{
+    auto model = ModelById::getAs<SparseTimeValueModel>(m_model);
+    if (!model) return;
+
+    EventVector points = model->getEventsWithin
+        (bucketNo * m_bucketWidth, m_bucketWidth);
+
+    if (size_t(bucketNo) >= m_buckets.size()) {
+        if (points.empty()) return;
+        m_buckets.resize(bucketNo + 1);
+        resizeLevels();
+    }
+
+    Bucket &b = m_buckets[bucketNo];
+    b.points.clear();
+    for (const auto &p: points) {
+        b.points.push_back({ p.getFrame(), p.getValue() });
+    }
+    summariseBucket(b);
+}
+
+void
+PitchTrackIndex::summariseBucket(Bucket &b)
+{
+    b.sorted.clear();
+    b.sorted.reserve(b.points.size());
+    for (const auto &p: b.points) {
+        b.sorted.push_back(p.second);
+    }
+    std::sort(b.sorted.begin(), b.sorted.end());
+    summarise(b);
+}
+
+void
+PitchTrackIndex::summarise(Node &n) const
+{
+    n.sum = 0.0;
+    for (float v: n.sorted) n.sum += v;
+    if (!n.sorted.empty()) {
+        n.min = *n.sorted.begin();
+        n.max = *n.sorted.rbegin();
+    }
+    n.dirty = false;
+}
+
+void
+PitchTrackIndex::resizeLevels()
+{
+    // The top level is the first whose nodes span all the buckets, or
+    // the last we allow
+    
+    size_t n = m_buckets.size();
+    int levels = 0;
+    while (levels < maxLevels) {
+        ++levels;
+        if (span(levels - 1) >= sv_frame_t(n)) break;
+    }
+    if (n == 0) levels = 0;
+
+    m_levels.resize(levels);
+    for (int l = 0; l < levels; ++l) {
+        sv_frame_t s = span(l);
+        m_levels[l].resize(size_t((sv_frame_t(n) + s - 1) / s));
+    }
+}
+
+void
+PitchTrackIndex::markDirty(sv_frame_t b0, sv_frame_t b1)
+{
+    for (int l = 0; l < int(m_levels.size()); ++l) {
+        sv_frame_t s = span(l);
+        sv_frame_t n = sv_frame_t(m_levels[l].size());
+        for (sv_frame_t j = b0 / s; j <= b1 / s && j < n; ++j) {
+            m_levels[l][j].dirty = true;
+        }
+    }
+}
+
+const PitchTrackIndex::Node &
+PitchTrackIndex::node(int level, sv_frame_t index) const
+{
+    if (level < 0) return m_buckets[index];
+
+    Node &n = m_levels[level][index];
+    if (!n.dirty) return n;
+
+    // Merge the children's sorted values into this node's
+
+    n.sorted.clear();
+
+    sv_frame_t c0 = index * fanout;
+    sv_frame_t c1 = c0 + fanout;
+    sv_frame_t children = (level == 0 ?
+                           sv_frame_t(m_buckets.size()) :
+                           sv_frame_t(m_levels[level-1].size()));
+    if (c1 > children) c1 = children;
+
+    for (sv_frame_t c = c0; c < c1; ++c) {
+        const Node &child = node(level - 1, c);
+        size_t mid = n.sorted.size();
+        n.sorted.insert(n.sorted.end(),
+                        child.sorted.begin(), child.sorted.end());
+        std::inplace_merge(n.sorted.begin(), n.sorted.begin() + mid,
+                           n.sorted.end());
+    }
+
+    summarise(n);
+    return n;
+}
+
+void
+PitchTrackIndex::modelChanged(ModelId)
+{
+    rebuild();
+}
+
+void
+PitchTrackIndex::modelChangedWithin(ModelId, sv_frame_t f0, sv_frame_t f1)
+{
+    refresh(f0, f1);
+}
+
+void
+PitchTrackIndex::refresh(sv_frame_t f0, sv_frame_t f1)
+{
+    if (f0 < 0) f0 = 0;
+    if (f1 <= f0) f1 = f0 + 1;
+
+    sv_frame_t b0 = f0 / m_bucketWidth;
+    sv_frame_t b1 = (f1 - 1) / m_bucketWidth;
+
+    if (b1 - b0 >= maxBucketsPerChange) {
+        rebuild();
+        return;
+    }
+
+    for (sv_frame_t b = b0; b <= b1; ++b) {
+        rebuildBucket(b);
+    }
+
+    markDirty(b0, b1);
+}
+
+void
+PitchTrackIndex::gather(sv_frame_t start, sv_frame_t duration,
+                        std::vector<const Node *> &whole,
+                        std::vector<float> &partial) const
+{
+    sv_frame_t end = start + duration;
+    if (start < 0) start = 0;
+    if (end <= start) return;
+
+    sv_frame_t nb = sv_frame_t(m_buckets.size());
+
+    auto scan = [&](sv_frame_t b) {
+        if (b < 0 || b >= nb) return;
+        for (const auto &p: m_buckets[b].points) {
+            if (p.first >= start && p.first < end) {
+                partial.push_back(p.second);
+            }
+        }
+    };
+
+    // Buckets [b0, b1) lie wholly within the range
+    sv_frame_t b0 = (start + m_bucketWidth - 1) / m_bucketWidth;
+    sv_frame_t b1 = end / m_bucketWidth;
+    if (b1 > nb) b1 = nb;
+
+    if (b0 >= b1) {
+        for (sv_frame_t b = start / m_bucketWidth;
+             b <= (end - 1) / m_bucketWidth && b < nb; ++b) {
+            scan(b);
+        }
+    } else {
+        if (start % m_bucketWidth != 0) scan(b0 - 1);
+        if (end % m_bucketWidth != 0) scan(b1);
+
+        // Cover [b0, b1) with the largest aligned nodes that fit
+        sv_frame_t b = b0;
+        while (b < b1) {
+            int level = int(m_levels.size()) - 1;
+            while (level >= 0 &&
+                   (b % span(level) != 0 || b + span(level) > b1)) {
+                --level;
+            }
+            sv_frame_t s = (level < 0 ? 1 : span(level));
+            whole.push_back(&node(level, level < 0 ? b : b / s));
+            b += s;
+        }
+    }
+
+    std::sort(partial.begin(), partial.end());
+}
+
+bool
+PitchTrackIndex::getSummary(sv_frame_t start, sv_frame_t duration,
+                            Summary &summary) const
+{
+    std::vector<const Node *> whole;
+    std::vector<float> partial;
+    gather(start, duration, whole, partial);
+
+    summary = Summary();
+
+    double sum = 0.0;
+    bool first = true;
+
+    auto include = [&](int n, double s, double mn, double mx) {
+        if (n == 0) return;
+        summary.count += n;
+        sum += s;
+        if (first || mn < summary.min) summary.min = mn;
+        if (first || mx > summary.max) summary.max = mx;
+        first = false;
+    };
+
+    for (const Node *n: whole) {
+        include(int(n->sorted.size()), n->sum, n->min, n->max);
+    }
+    if (!partial.empty()) {
+        double s = 0.0;
+        for (float v: partial) s += v;
+        include(int(partial.size()), s, *partial.begin(), *partial.rbegin());
+    }
+
+    if (summary.count == 0) return false;
+    summary.mean = sum / summary.count;
+    return true;
+}
+
+float
+PitchTrackIndex::kth(const std::vector<const Node *> &whole,
+                     const std::vector<float> &partial, int k) const
+{
+    // Bisect over the ordered keys of the values, counting the values
+    // at or below each candidate key with a binary search in each
+    // sorted node. This takes at most 32 rounds, each costing a
+    // logarithmic search per node
+
+    auto keyAbove = [](uint32_t key, float v) { return key < keyFor(v); };
+
+    auto countUpTo = [&](uint32_t key) {
+        size_t n = std::upper_bound(partial.begin(), partial.end(),
+                                    key, keyAbove) - partial.begin();
+        for (const Node *w: whole) {
+            n += std::upper_bound(w->sorted.begin(), w->sorted.end(),
+                                  key, keyAbove) - w->sorted.begin();
+        }
+        return n;
+    };
+
+    uint32_t lo = 0xffffffffu, hi = 0;
+    if (!partial.empty()) {
+        lo = keyFor(*partial.begin());
+        hi = keyFor(*partial.rbegin());
+    }
+    for (const Node *w: whole) {
+        if (w->sorted.empty()) continue;
+        lo = std::min(lo, keyFor(w->min));
+        hi = std::max(hi, keyFor(w->max));
+    }
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (countUpTo(mid) > size_t(k)) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return valueFor(lo);
+}
+
+bool
+PitchTrackIndex::getMedian(sv_frame_t start, sv_frame_t duration,
+                           double &median) const
+{
+    std::vector<const Node *> whole;
+    std::vector<float> partial;
+    gather(start, duration, whole, partial);
+
+    int n = int(partial.size());
+    for (const Node *w: whole) {
+        n += int(w->sorted.size());
+    }
+    if (n == 0) return false;
+
+    if (n <= maxValuesToCopy) {
+
+        // A typical note: just select from a copy of its values
+        
+        std::vector<float> values(partial);
+        for (const Node *w: whole) {
+            values.insert(values.end(), w->sorted.begin(), w->sorted.end());
+        }
+        auto mid = values.begin() + n/2;
+        std::nth_element(values.begin(), mid, values.end());
+        median = *mid;
+        if (n % 2 == 0) {
+            median = (double(*std::max_element(values.begin(), mid)) +
+                      median) / 2;
+        }
+        return true;
+    }
+
+    if (n % 2 == 0) {
+        median = (double(kth(whole, partial, n/2 - 1)) +
+                  double(kth(whole, partial, n/2))) / 2;
+    } else {
+        median = kth(whole, partial, n/2);
+    }
+
+    return true;
+}
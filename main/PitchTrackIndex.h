@@ -0,0 +1,142 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef PITCH_TRACK_INDEX_H
+#define PITCH_TRACK_INDEX_H
+
+#include "data/model/Model.h"
+
+#include <QObject>
+
+#include <vector>
+
+/**
+ * Index of the values in a SparseTimeValueModel pitch track, for
+ * answering median, mean, minimum and maximum queries over a frame
+ * range without retrieving and sorting every point in it.
+ *
+ * Points are held in fixed-width buckets of frames. Above the buckets
+ * sits a tree of nodes with a fanout of 8, each holding the sorted
+ * values of the buckets beneath it together with their sum, minimum
+ * and maximum. A query range is covered by the individual points of
+ * the partial buckets at either end and a handful of tree nodes (at
+ * most 14 per level), so a summary costs O(log n) and a median,
+ * which bisects over the values with a binary search in each node,
+ * O(log^2 n) for ranges up to the span of a top-level node. The tree
+ * is capped at four levels (4096 buckets) so that an edit never
+ * re-sorts more than that span; longer ranges add one node for each
+ * further top-level span they cover.
+ *
+ * Buckets are rebuilt as the model reports changes within them, and
+ * the nodes above them are re-merged the next time a query uses them.
+ */
+class PitchTrackIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    PitchTrackIndex(QObject *parent = 0);
+    virtual ~PitchTrackIndex();
+
+    /**
+     * Index the given pitch-track model, replacing any previous one.
+     * Pass an empty id to clear the index.
+     */
+    void setModel(ModelId model);
+    ModelId getModel() const { return m_model; }
+
+    /**
+     * Re-read the given frame range from the model. The index does
+     * this itself when the model reports a change, but a caller that
+     * has blocked the model's signals (see ModelTransaction) must do
+     * it before querying a range it has changed.
+     */
+    void refresh(sv_frame_t start, sv_frame_t end);
+
+    struct Summary {
+        Summary() : count(0), mean(0), min(0), max(0) { }
+        int count;
+        double mean;
+        double min;
+        double max;
+    };
+
+    /**
+     * Summarise the points whose frames lie within the given range.
+     * Return false if there are none.
+     */
+    bool getSummary(sv_frame_t start, sv_frame_t duration,
+                    Summary &summary) const;
+
+    /**
+     * Find the median of the values of the points whose frames lie
+     * within the given range, taking the mean of the middle two if
+     * there is an even number of them. Return false if there are
+     * none.
+     */
+    bool getMedian(sv_frame_t start, sv_frame_t duration,
+                   double &median) const;
+
+protected slots:
+    void modelChanged(ModelId);
+    void modelChangedWithin(ModelId, sv_frame_t, sv_frame_t);
+
+protected:
+    struct Node {
+        Node() : sum(0), min(0), max(0), dirty(true) { }
+        std::vector<float> sorted; // values only, ascending
+        double sum;
+        float min;
+        float max;
+        bool dirty; // sorted values and summary need re-merging
+    };
+
+    struct Bucket : Node {
+        std::vector<std::pair<sv_frame_t, float>> points; // by frame
+    };
+
+    ModelId m_model;
+    sv_frame_t m_bucketWidth;
+
+    // indexed by bucket number (frame / m_bucketWidth)
+    std::vector<Bucket> m_buckets;
+
+    // m_levels[l][j] covers buckets j * span(l) to (j+1) * span(l),
+    // where span(l) is 8^(l+1). Nodes are merged lazily from their
+    // children when a query reaches them, so they are mutable
+    mutable std::vector<std::vector<Node>> m_levels;
+
+    static sv_frame_t span(int level);
+
+    void rebuild();
+    void rebuildBucket(sv_frame_t bucketNo);
+    void summariseBucket(Bucket &);
+    void summarise(Node &) const;
+    void resizeLevels();
+    void markDirty(sv_frame_t b0, sv_frame_t b1);
+    const Node &node(int level, sv_frame_t index) const;
+
+    // Gather the nodes (buckets or tree nodes) that together cover
+    // exactly the buckets lying wholly within the range, and the
+    // values of points in the range that lie in partial buckets at
+    // either end (sorted)
+    void gather(sv_frame_t start, sv_frame_t duration,
+                std::vector<const Node *> &whole,
+                std::vector<float> &partial) const;
+
+    float kth(const std::vector<const Node *> &whole,
+              const std::vector<float> &partial, int k) const;
+};
+
+#endif
@@ -0,0 +1,244 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "RangeTransformCommand.h"
+#include "ModelTransaction.h"
+
+#include "data/model/SparseTimeValueModel.h"
+
+std::atomic<size_t>
+RangeTransformCommand::m_totalBytes(0);
+
+std::atomic<size_t>
+RangeTransformCommand::m_executedBytes(0);
+
+RangeTransformCommand::PointVector
+RangeTransformCommand::capture(ModelId modelId,
+                               sv_frame_t start, sv_frame_t duration)
+{
+    PointVector points;
+    auto model = ModelById::getAs<SparseTimeValueModel>(modelId);
+    if (!model) return points;
+
+    EventVector events = model->getEventsWithin(start, duration);
+    points.reserve(events.size());
+    for (const auto &e: events) {
+        points.push_back(Point(e));
+    }
+    return points;
+}
+
+size_t
+RangeTransformCommand::getByteCount(const PointVector &points)
+{
+    size_t bytes = points.capacity() * sizeof(Point);
+    for (const auto &p: points) {
+        if (!p.label.isEmpty()) {
+            bytes += p.label.size() * sizeof(QChar);
+        }
+        if (p.full) {
+            bytes += sizeof(Event);
+        }
+    }
+    return bytes;
+}
+
+RangeTransformCommand::RangeTransformCommand(ModelId model,
+                                             sv_frame_t start,
+                                             sv_frame_t duration,
+                                             float factor,
+                                             QString name) :
+    m_model(model),
+    m_operation(Scale),
+    m_start(start),
+    m_duration(duration),
+    m_factor(factor),
+    m_name(name),
+    m_bytes(0),
+    m_executed(false)
+{
+    captureBefore();
+    countBytes();
+}
+
+RangeTransformCommand::RangeTransformCommand(ModelId model,
+                                             sv_frame_t start,
+                                             sv_frame_t duration,
+                                             QString name) :
+    m_model(model),
+    m_operation(Delete),
+    m_start(start),
+    m_duration(duration),
+    m_factor(1.f),
+    m_name(name),
+    m_bytes(0),
+    m_executed(false)
+{
+    captureBefore();
+    countBytes();
+}
+
+RangeTransformCommand::RangeTransformCommand(ModelId model,
+                                             sv_frame_t start,
+                                             sv_frame_t duration,
+                                             const EventVector &replacement,
+                                             QString name) :
+    m_model(model),
+    m_operation(Replace),
+    m_start(start),
+    m_duration(duration),
+    m_factor(1.f),
+    m_name(name),
+    m_bytes(0),
+    m_executed(false)
+{
+    captureBefore();
+
+    m_after.reserve(replacement.size());
+    for (const auto &e: replacement) {
+        if (e.getFrame() >= m_start && e.getFrame() < m_start + m_duration) {
+            m_after.push_back(Point(e));
+        }
+    }
+
+    countBytes();
+}
+
+RangeTransformCommand::RangeTransformCommand(ModelId model,
+                                             sv_frame_t start,
+                                             sv_frame_t duration,
+                                             const PointVector &replacement,
+                                             QString name) :
+    m_model(model),
+    m_operation(Replace),
+    m_start(start),
+    m_duration(duration),
+    m_factor(1.f),
+    m_name(name),
+    m_bytes(0),
+    m_executed(false)
+{
+    captureBefore();
+
+    for (const auto &p: replacement) {
+        if (p.frame >= m_start && p.frame < m_start + m_duration) {
+            m_after.push_back(p);
+        }
+    }
+    m_after.shrink_to_fit();
+
+    countBytes();
+}
+
+RangeTransformCommand::~RangeTransformCommand()
+{
+    m_totalBytes -= m_bytes;
+    if (m_executed) m_executedBytes -= m_bytes;
+}
+
+void
+RangeTransformCommand::countBytes()
+{
+    m_bytes = sizeof(*this) + getByteCount(m_before) + getByteCount(m_after);
+    m_totalBytes += m_bytes;
+}
+
+void
+RangeTransformCommand::captureBefore()
+{
+    m_before = capture(m_model, m_start, m_duration);
+}
+
+bool
+RangeTransformCommand::isEmpty() const
+{
+    switch (m_operation) {
+    case Scale: return m_before.empty() || m_factor == 1.f;
+    case Delete: return m_before.empty();
+    case Replace: return m_before.empty() && m_after.empty();
+    }
+    return true;
+}
+
+RangeTransformCommand::PointVector
+RangeTransformCommand::getAfter() const
+{
+    if (m_operation == Replace) {
+        return m_after;
+    }
+
+    PointVector after;
+    if (m_operation == Scale) {
+        after = m_before;
+        for (auto &p: after) {
+            // Events with no value are left as they are
+            if (p.hasValue) {
+                p.value *= m_factor;
+            }
+        }
+    }
+    return after;
+}
+
+void
+RangeTransformCommand::apply(const PointVector &to)
+{
+    auto model = ModelById::getAs<SparseTimeValueModel>(m_model);
+    if (!model) return;
+
+    // Report the whole edit as one change over our range, rather
+    // than one per point
+    ModelTransaction transaction({ m_model });
+    transaction.addRange(m_start,
+                         m_start + m_duration + model->getResolution());
+
+    // Remove the events that are actually in the range now (which
+    // the undo history ensures are those we left there last time)
+    // rather than ones rebuilt from our points: removal needs an
+    // exact match, and a rebuilt event that failed to match would
+    // leave a duplicate behind.
+    //
+    // This is still one model add or remove per point, each of which
+    // takes the model's lock and updates its event series and
+    // extents separately, so an edit costs as much model work as the
+    // equivalent run of single-point commands did -- what we save is
+    // the per-point commands and notifications, and the undo memory.
+    // Rebuilding the range in one go would need a bulk replace in
+    // svcore's SparseTimeValueModel, which it does not have
+    EventVector current = model->getEventsWithin(m_start, m_duration);
+    for (const auto &e: current) {
+        model->remove(e);
+    }
+    for (const auto &p: to) {
+        model->add(p.toEvent());
+    }
+
+    transaction.commit();
+}
+
+void
+RangeTransformCommand::execute()
+{
+    apply(getAfter());
+    if (!m_executed) m_executedBytes += m_bytes;
+    m_executed = true;
+}
+
+void
+RangeTransformCommand::unexecute()
+{
+    apply(m_before);
+    if (m_executed) m_executedBytes -= m_bytes;
+    m_executed = false;
+}
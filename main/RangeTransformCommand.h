@@ -0,0 +1,158 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Tony
+    An intonation analysis and annotation tool
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef RANGE_TRANSFORM_COMMAND_H
+#define RANGE_TRANSFORM_COMMAND_H
+
+#include "base/Command.h"
+#include "base/Event.h"
+#include "data/model/Model.h"
+
+#include <QString>
+
+#include <vector>
+#include <atomic>
+#include <memory>
+
+/**
+ * A command that transforms all of the events of a
+ * SparseTimeValueModel within a frame range at once: scaling their
+ * values, deleting them, or replacing them with a given set of
+ * events. Only the frame, value (if any) and label of each event are
+ * kept for undo, rather than one sub-command and a full Event per
+ * point as with ChangeEventsCommand. An event with anything more
+ * than that (which a pitch track does not normally have) is kept
+ * whole.
+ */
+class RangeTransformCommand : public Command
+{
+public:
+    /**
+     * The part of an event that a pitch track uses.
+     */
+    struct Point {
+        Point(const Event &e) :
+            frame(e.getFrame()),
+            value(e.getValue()),
+            hasValue(e.hasValue()),
+            label(e.getLabel()) {
+            if (e.hasDuration() || e.hasLevel() ||
+                e.hasReferenceFrame() || e.getURI() != "") {
+                full = std::make_shared<Event>(e);
+            }
+        }
+        Event toEvent() const {
+            if (full) return hasValue ? full->withValue(value) : *full;
+            if (hasValue) return Event(frame, value, label);
+            return Event(frame, label);
+        }
+        sv_frame_t frame;
+        float value;
+        bool hasValue;
+        QString label;
+        std::shared_ptr<const Event> full; // only if there is more to it
+    };
+    typedef std::vector<Point> PointVector;
+
+    /**
+     * Return the points of the given SparseTimeValueModel within the
+     * given range, in compact form, e.g. to restore later using the
+     * replacing constructor below.
+     */
+    static PointVector capture(ModelId model,
+                               sv_frame_t start, sv_frame_t duration);
+
+    /**
+     * Multiply the values of all events in the range by factor.
+     */
+    RangeTransformCommand(ModelId model,
+                          sv_frame_t start, sv_frame_t duration,
+                          float factor, QString name);
+
+    /**
+     * Remove all events in the range.
+     */
+    RangeTransformCommand(ModelId model,
+                          sv_frame_t start, sv_frame_t duration,
+                          QString name);
+
+    /**
+     * Replace all events in the range with those of replacement
+     * that fall within the range.
+     */
+    RangeTransformCommand(ModelId model,
+                          sv_frame_t start, sv_frame_t duration,
+                          const EventVector &replacement, QString name);
+    RangeTransformCommand(ModelId model,
+                          sv_frame_t start, sv_frame_t duration,
+                          const PointVector &replacement, QString name);
+
+    virtual ~RangeTransformCommand();
+
+    void execute() override;
+    void unexecute() override;
+    QString getName() const override { return m_name; }
+
+    /**
+     * Return true if executing this command would change nothing.
+     */
+    bool isEmpty() const;
+
+    /**
+     * Return the approximate memory used by this command, in bytes.
+     */
+    size_t getByteCount() const { return m_bytes; }
+
+    /**
+     * Return the approximate memory used by all range-transform
+     * commands currently in existence, in bytes. As the command
+     * history deletes the commands it no longer holds, this is the
+     * undo memory used by pitch-track edits.
+     */
+    static size_t getTotalByteCount() { return m_totalBytes; }
+
+    /**
+     * Return the approximate memory used by range-transform commands
+     * that are currently executed, i.e. those on the undo stack (or
+     * in a compound command not yet added to it) rather than the
+     * redo stack.
+     */
+    static size_t getExecutedByteCount() { return m_executedBytes; }
+
+    static size_t getByteCount(const PointVector &);
+
+protected:
+    enum Operation { Scale, Delete, Replace };
+
+    ModelId m_model;
+    Operation m_operation;
+    sv_frame_t m_start;
+    sv_frame_t m_duration;
+    float m_factor;
+    QString m_name;
+    PointVector m_before;
+    PointVector m_after; // only for Replace; Scale recomputes it
+    size_t m_bytes;
+    bool m_executed;
+
+    static std::atomic<size_t> m_totalBytes;
+    static std::atomic<size_t> m_executedBytes;
+
+    void captureBefore();
+    void countBytes();
+    PointVector getAfter() const;
+    void apply(const PointVector &to);
+};
+
+#endif
@@ -14,6 +14,7 @@
 */
 
 #include "MainWindow.h"
+#include "BatchAnalyser.h"
 
 #include "system/System.h"
 #include "system/Init.h"
@@ -199,6 +200,72 @@ setupTonyVampPath()
     putEnvQStr(env);
 }
         
+static int
+runBatchAnalysis(int &argc, char **argv)
+{
+    // Batch mode opens no windows, so it has a core application
+    // rather than a GUI one and can run without a display
+
+    QCoreApplication application(argc, argv);
+
+    setupTonyVampPath();
+
+    QStringList args = application.arguments();
+    int batchArg = args.indexOf("--batch");
+    if (batchArg < 0 || batchArg + 1 >= args.size()) {
+        std::cerr << "--batch requires a folder argument" << std::endl;
+        return 2;
+    }
+    QString directory = args[batchArg + 1];
+
+    PluginScan::getInstance()->scan();
+
+    BatchAnalyser batch;
+
+    int n = batch.addDirectory(directory);
+    if (n == 0) {
+        cerr << "No audio files found in \"" << directory << "\"" << endl;
+        return 1;
+    }
+
+    cerr << "Analysing " << n << " audio file(s) in \"" << directory
+         << "\"..." << endl;
+
+    QObject::connect
+        (&batch, &BatchAnalyser::fileDone,
+         [&](QString path, QString error, double elapsed, double duration) {
+             if (error != "") {
+                 cerr << "[" << batch.getDone() << "/" << batch.getTotal()
+                      << "] FAILED: " << path << ": " << error << endl;
+             } else {
+                 cerr << "[" << batch.getDone() << "/" << batch.getTotal()
+                      << "] " << path << ": " << duration
+                      << " sec of audio in " << elapsed << " sec" << endl;
+             }
+         });
+
+    QObject::connect
+        (&batch, &BatchAnalyser::finished,
+         [&](int succeeded, int failed, int cancelled) {
+             cerr << "Done: " << succeeded << " succeeded, "
+                  << failed << " failed";
+             if (cancelled > 0) {
+                 cerr << ", " << cancelled << " cancelled";
+             }
+             cerr << endl;
+             application.exit(failed > 0 ? 1 : 0);
+         });
+
+    batch.start();
+
+    int rv = application.exec();
+
+    TransformFactory::deleteInstance();
+    TempDirectory::getInstance()->cleanup();
+
+    return rv;
+}
+        
 int
 main(int argc, char **argv)
 {
@@ -210,16 +277,10 @@ main(int argc, char **argv)
 
     svSystemSpecificInitialisation();
 
-    TonyApplication application(argc, argv);
-
     QApplication::setOrganizationName("sonic-visualiser");
     QApplication::setOrganizationDomain("sonicvisualiser.org");
     QApplication::setApplicationName("Tony");
 
-    setupTonyVampPath();
-
-    QStringList args = application.arguments();
-
     signal(SIGINT,  signalHandler);
     signal(SIGTERM, signalHandler);
 
@@ -228,13 +289,27 @@ main(int argc, char **argv)
     signal(SIGQUIT, signalHandler);
 #endif
 
+    // Decide on batch mode before constructing any application
+    // object, as it must not have a GUI one
+    for (int i = 1; i < argc; ++i) {
+        if (QString(argv[i]) == "--batch") {
+            return runBatchAnalysis(argc, argv);
+        }
+    }
+
+    TonyApplication application(argc, argv);
+
+    setupTonyVampPath();
+
+    QStringList args = application.arguments();
+
     bool audioOutput = true;
     bool sonification = true;
     bool spectrogram = true;
 
     if (args.contains("--help") || args.contains("-h") || args.contains("-?")) {
         std::cerr << QApplication::tr(
-            "\nTony is a program for interactive note and pitch analysis and annotation.\n\nUsage:\n\n  %1 [--no-audio] [--no-sonification] [--no-spectrogram] [<file> ...]\n\n  --no-audio: Do not attempt to open an audio output device\n  --no-sonification: Disable sonification of pitch tracks and notes and hide their toggles.\n  --no-spectrogram: Disable spectrogram.\n  <file>: One or more Tony (.ton) and audio files may be provided.").arg(argv[0]).toStdString() << std::endl;
+            "\nTony is a program for interactive note and pitch analysis and annotation.\n\nUsage:\n\n  %1 [--no-audio] [--no-sonification] [--no-spectrogram] [<file> ...]\n  %1 --batch <folder>\n\n  --batch: Analyse every audio file in <folder> without opening a window, writing pitch track and notes to .pitch.csv and .notes.csv files alongside each one.\n  --no-audio: Do not attempt to open an audio output device\n  --no-sonification: Disable sonification of pitch tracks and notes and hide their toggles.\n  --no-spectrogram: Disable spectrogram.\n  <file>: One or more Tony (.ton) and audio files may be provided.").arg(argv[0]).toStdString() << std::endl;
         exit(2);
     }
 
@@ -59,10 +59,22 @@ for (file, SVAPP_HEADERS)    { HEADERS += $$sprintf("svapp/%1",    $$file) }
 
 HEADERS += main/MainWindow.h \
            main/NetworkPermissionTester.h \
-           main/Analyser.h
+           main/Analyser.h \
+           main/AnalysisCache.h \
+           main/BatchAnalyser.h \
+           main/RangeTransformCommand.h \
+           main/NoteBoundaryIndex.h \
+           main/PitchTrackIndex.h \
+           main/ModelTransaction.h
 
 SOURCES += main/main.cpp \
            main/Analyser.cpp \
+           main/AnalysisCache.cpp \
+           main/BatchAnalyser.cpp \
+           main/RangeTransformCommand.cpp \
+           main/NoteBoundaryIndex.cpp \
+           main/PitchTrackIndex.cpp \
+           main/ModelTransaction.cpp \
            main/NetworkPermissionTester.cpp \
            main/MainWindow.cpp
 